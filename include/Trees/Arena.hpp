@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace Trees {
+
+    // Arena policies for SearchTree node blocks. An arena
+    //     void*  allocate(size_t& bytes, size_t alignment)   - may round bytes up and reports
+    //                                                          the usable size back
+    //     void   deallocate(void* p, size_t bytes, size_t alignment)
+    //     size_t next_capacity(size_t prev_capacity) const   - nodes in the next block
+    // Copies of an arena must be able to free each other's blocks.
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Block growth ------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    // first block of first_ nodes, then prev * factor_, never above max_ (0 - unlimited)
+    class BlockGrowth
+    {
+        public:
+            void set_growth(size_t first, double factor, size_t max = 0)
+            {
+                first_  = first ? first : 1;
+                factor_ = factor > 1.0 ? factor : 1.0;
+                max_    = max;
+            }
+
+            size_t next_capacity(size_t prev_capacity) const
+            {
+                size_t capacity = prev_capacity ? static_cast<size_t>(prev_capacity * factor_) : first_;
+                if (capacity < first_)            capacity = first_;
+                if (max_ && capacity > max_)      capacity = max_;
+                return capacity;
+            }
+
+        private:
+            size_t first_  = 512;
+            double factor_ = 2.0;
+            size_t max_    = 0;
+    };
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Heap (default) ----------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    class HeapArena : public BlockGrowth
+    {
+        public:
+            void* allocate(size_t& bytes, size_t) { return ::operator new[](bytes); }
+            void  deallocate(void* p, size_t, size_t) { ::operator delete[](p); }
+    };
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Huge pages --------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    // blocks are rounded up to 2 MiB and mapped with MAP_HUGETLB; without reserved huge
+    // pages falls back to a plain mapping with madvise(MADV_HUGEPAGE) (transparent huge pages).
+    // Outside Linux behaves like HeapArena.
+    class HugePageArena : public BlockGrowth
+    {
+        public:
+            static constexpr size_t huge_page_size = size_t{2} << 20;
+
+            void* allocate(size_t& bytes, size_t alignment)
+            {
+#if defined(__linux__)
+                (void)alignment;
+                bytes   = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+                void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (p != MAP_FAILED) return p;
+
+                p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED) throw std::bad_alloc();
+                ::madvise(p, bytes, MADV_HUGEPAGE);
+                return p;
+#else
+                return heap_.allocate(bytes, alignment);
+#endif
+            }
+
+            void deallocate(void* p, size_t bytes, size_t alignment)
+            {
+#if defined(__linux__)
+                (void)alignment;
+                ::munmap(p, bytes);
+#else
+                heap_.deallocate(p, bytes, alignment);
+#endif
+            }
+
+#if !defined(__linux__)
+        private:
+            HeapArena heap_;
+#endif
+    };
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- std::pmr upstream -------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    class PmrArena : public BlockGrowth
+    {
+        public:
+            PmrArena() = default;
+            explicit PmrArena(std::pmr::memory_resource* upstream): upstream_(upstream) {}
+
+            void* allocate(size_t& bytes, size_t alignment) { return upstream_->allocate(bytes, alignment); }
+            void  deallocate(void* p, size_t bytes, size_t alignment) { upstream_->deallocate(p, bytes, alignment); }
+
+            std::pmr::memory_resource* upstream() const { return upstream_; }
+
+        private:
+            std::pmr::memory_resource* upstream_ = std::pmr::get_default_resource();
+    };
+
+}
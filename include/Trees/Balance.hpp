@@ -0,0 +1,298 @@
+#pragma once
+
+#include <cstdint>
+
+// internal to Balance.hpp and Tree.hpp, undefined at the end of Tree.hpp
+#ifdef TREES_INSTRUMENT
+#define TREES_DETAIL_COUNT_OF(tree, counter) (++(tree).counters_.counter)
+#else
+#define TREES_DETAIL_COUNT_OF(tree, counter) ((void)(tree))
+#endif
+#define TREES_DETAIL_COUNT(counter) TREES_DETAIL_COUNT_OF(*this, counter)
+
+namespace Trees {
+
+    // work done by the balancing code, collected only with TREES_INSTRUMENT
+    struct OpCounters
+    {
+        long long metric_updates = 0; // rewrites of the balance metadata (height_/rank)
+        long long size_updates   = 0; // size_ adjustments on the insertion/erase paths
+        long long rotations      = 0;
+    };
+
+    // Balancing policies for SearchTree. A policy is a friend of the tree and sees
+    // its nodes and rotate_left/rotate_right; rotations keep size_ up to date, the
+    // policy owns node->height_. The tree calls
+    //     after_insert(tree, node)          - node is a fresh leaf, sizes already include it
+    //     after_erase (tree, parent, child) - child replaced an unlinked node under parent,
+    //                                         sizes are already recomputed
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- AVL ---------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    // height_ is the subtree height, |h(left) - h(right)| <= 1
+    struct AvlBalance
+    {
+        static constexpr const char* name = "avl"; // snapshot tag
+
+        template <typename Tree, typename Node>
+        void after_insert(Tree& tree, Node* node)
+        {
+            // the walk ends as soon as the subtree height stops changing
+            // or one (single/double) rotation restored it
+            Node* current_root = node->parent_;
+            while (current_root)
+            {
+                int old_height = current_root->height_;
+
+                update_height(tree, current_root);
+                int bf  = balance_factor(current_root);
+
+                if (bf <-1 ||bf > 1)
+                {
+                    balance(tree, current_root, bf);
+                    return;
+                }
+                if (current_root->height_ == old_height) return;
+
+                current_root = current_root->parent_;
+            }
+        }
+
+        template <typename Tree, typename Node>
+        void after_erase(Tree& tree, Node* parent, Node*)
+        {
+            Node* current_root = parent;
+            while (current_root)
+            {
+                update_height(tree, current_root);
+                int bf  = balance_factor(current_root);
+
+                if (bf <-1 ||bf > 1)
+                {
+                    current_root = balance(tree, current_root, bf);
+                }
+                current_root = current_root->parent_;
+            }
+        }
+
+    private:
+        template <typename Node>
+        static int height(Node* node) { return node ? node->height_ : 0; }
+
+        template <typename Tree, typename Node>
+        static void update_height(Tree& tree, Node* root)
+        {
+            TREES_DETAIL_COUNT_OF(tree, metric_updates);
+            int max_height = height(root->left()) > height(root->right()) ? height(root->left()) : height(root->right());
+            root->height_  = 1 + max_height;
+        }
+
+        template <typename Node>
+        static int balance_factor(Node* current_root) { return height(current_root->left()) - height(current_root->right()); }
+
+        template <typename Tree, typename Node>
+        static Node* rotate_right(Tree& tree, Node* root)
+        {
+            Node* new_root = tree.rotate_right(root);
+            update_height(tree, root);
+            update_height(tree, new_root);
+            return new_root;
+        }
+
+        template <typename Tree, typename Node>
+        static Node* rotate_left(Tree& tree, Node* root)
+        {
+            Node* new_root = tree.rotate_left(root);
+            update_height(tree, root);
+            update_height(tree, new_root);
+            return new_root;
+        }
+
+        template <typename Tree, typename Node>
+        static Node* balance(Tree& tree, Node* root, int bf)
+        {
+            if (bf > 1)
+            {
+                if (root->left() && balance_factor(root->left()) < 0)
+                    rotate_left(tree, root->left());
+                root = rotate_right(tree, root);
+            }
+            else if (bf < -1)
+            {
+                if (root->right() && balance_factor(root->right()) > 0)
+                    rotate_right(tree, root->right());
+                root = rotate_left(tree, root);
+            }
+
+            return root;
+        }
+    };
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- WAVL --------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    // weak AVL (Haeupler, Sen, Tarjan): height_ is rank + 1, every rank difference is 1 or 2
+    // and leaves are 1,1. Insertion does at most two rotations and the same promotions as AVL,
+    // deletion at most two rotations; with inserts only the tree is an AVL tree.
+    struct WavlBalance
+    {
+        static constexpr const char* name = "wavl"; // snapshot tag
+
+        template <typename Tree, typename Node>
+        void after_insert(Tree& tree, Node* x)
+        {
+            Node* p = x->parent_;
+            while (p && rank(p) == rank(x)) // x is a 0-child
+            {
+                Node* sibling = (p->left() == x) ? p->right() : p->left();
+                if (rank(p) - rank(sibling) == 1) // p is 0,1: promote and go up
+                {
+                    promote(tree, p);
+                    x = p;
+                    p = p->parent_;
+                    continue;
+                }
+
+                // p is 0,2
+                if (p->left() == x)
+                {
+                    Node* y = x->right();
+                    if (rank(x) - rank(y) == 2)
+                    {
+                        tree.rotate_right(p);
+                        demote(tree, p);
+                    }
+                    else
+                    {
+                        tree.rotate_left(x);
+                        tree.rotate_right(p);
+                        promote(tree, y);
+                        demote(tree, x);
+                        demote(tree, p);
+                    }
+                }
+                else
+                {
+                    Node* y = x->left();
+                    if (rank(x) - rank(y) == 2)
+                    {
+                        tree.rotate_left(p);
+                        demote(tree, p);
+                    }
+                    else
+                    {
+                        tree.rotate_right(x);
+                        tree.rotate_left(p);
+                        promote(tree, y);
+                        demote(tree, x);
+                        demote(tree, p);
+                    }
+                }
+                return;
+            }
+        }
+
+        template <typename Tree, typename Node>
+        void after_erase(Tree& tree, Node* p, Node* x)
+        {
+            if (!p) return;
+
+            if (!p->left() && !p->right() && rank(p) == 2) // 2,2 leaf (rank 1)
+            {
+                demote(tree, p);
+                x = p;
+                p = p->parent_;
+            }
+
+            while (p && rank(p) - rank(x) == 3) // x is a 3-child
+            {
+                Node* y = (p->left() == x) ? p->right() : p->left();
+                if (rank(p) - rank(y) == 2)
+                {
+                    demote(tree, p);
+                }
+                else if (rank(y) - rank(y->left()) == 2 && rank(y) - rank(y->right()) == 2)
+                {
+                    demote(tree, p);
+                    demote(tree, y);
+                }
+                else
+                {
+                    bool  x_left = (p->left() == x);
+                    Node* outer  = x_left ? y->right() : y->left();
+                    Node* inner  = x_left ? y->left()  : y->right();
+
+                    if (rank(y) - rank(outer) == 1)
+                    {
+                        x_left ? tree.rotate_left(p) : tree.rotate_right(p);
+                        promote(tree, y);
+                        demote(tree, p);
+                        if (!p->left() && !p->right()) demote(tree, p);
+                    }
+                    else
+                    {
+                        x_left ? tree.rotate_right(y) : tree.rotate_left(y);
+                        x_left ? tree.rotate_left(p)  : tree.rotate_right(p);
+                        promote(tree, inner);
+                        promote(tree, inner);
+                        demote(tree, y);
+                        demote(tree, p);
+                        demote(tree, p);
+                    }
+                    return;
+                }
+                x = p;
+                p = p->parent_;
+            }
+        }
+
+    private:
+        template <typename Node>
+        static int rank(Node* node) { return node ? node->height_ : 0; } // shifted by one
+
+        template <typename Tree, typename Node>
+        static void promote(Tree& tree, Node* node) { TREES_DETAIL_COUNT_OF(tree, metric_updates); ++node->height_; }
+
+        template <typename Tree, typename Node>
+        static void demote(Tree& tree, Node* node)  { TREES_DETAIL_COUNT_OF(tree, metric_updates); --node->height_; }
+    };
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Treap -------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    // randomized treap: height_ holds a random priority, parents have the larger one.
+    // Expected O(1) rotations per insert, erase needs none (the spliced child keeps the heap order).
+    struct TreapBalance
+    {
+        static constexpr const char* name = "treap"; // snapshot tag
+
+        template <typename Tree, typename Node>
+        void after_insert(Tree& tree, Node* node)
+        {
+            TREES_DETAIL_COUNT_OF(tree, metric_updates);
+            node->height_ = next_priority();
+
+            while (node->parent_ && node->parent_->height_ < node->height_)
+            {
+                if (node->parent_->left() == node) tree.rotate_right(node->parent_);
+                else                              tree.rotate_left(node->parent_);
+            }
+        }
+
+        template <typename Tree, typename Node>
+        void after_erase(Tree&, Node*, Node*) {}
+
+    private:
+        std::uint64_t state_ = 0x9E3779B97F4A7C15ull;
+
+        int next_priority() // xorshift64
+        {
+            state_ ^= state_ << 13;
+            state_ ^= state_ >> 7;
+            state_ ^= state_ << 17;
+            return static_cast<int>(state_ >> 33);
+        }
+    };
+
+}
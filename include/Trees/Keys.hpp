@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace Trees {
+
+    // Key traits: how SearchTree builds the key stored in a node (or in the write buffer)
+    //     KeyT make(args...)            - from the insert/emplace arguments or a stored key
+    //     static constexpr bool owns_bytes - keys point into memory owned by the traits
+    //                                       object; such trees copy keys one by one and
+    //                                       cannot be saved as snapshots
+    // A tree holds one traits object; its copy starts empty and gets every key again.
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Default -----------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT>
+    struct KeyTraits
+    {
+        static constexpr bool owns_bytes = false;
+
+        template <typename... Args>
+        KeyT make(Args&&... args) { return KeyT(std::forward<Args>(args)...); }
+    };
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Strings with an inline prefix -------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    // string key that keeps its first 8 bytes inline as a big-endian integer (zero padded),
+    // so most comparisons are one integer compare inside the node; the bytes are followed
+    // only on a prefix tie. Built from a string_view it only refers to the caller's bytes,
+    // the tree copies them into its own arena when the key gets a node.
+    // Use with the default std::less<PrefixString>: lookups then convert the argument
+    // (and compute its prefix) once, not in every comparison.
+    class PrefixString
+    {
+        public:
+            PrefixString() = default;
+            PrefixString(std::string_view str): data_(str.data()), size_(str.size()), prefix_(load_prefix(str)) {}
+            PrefixString(const char* str): PrefixString(std::string_view(str)) {}
+            PrefixString(const std::string& str): PrefixString(std::string_view(str)) {}
+
+            std::string_view view()   const { return std::string_view(data_, size_); }
+            std::uint64_t    prefix() const { return prefix_; }
+            operator std::string_view() const { return view(); }
+
+            // on a prefix tie two keys of 8+ bytes share their first 8 bytes, only the rest
+            // is compared; a shorter key is zero padded in the prefix, so it needs the whole view
+            friend bool operator<(const PrefixString& a, const PrefixString& b)
+            {
+                if (a.prefix_ != b.prefix_) return a.prefix_ < b.prefix_;
+                if (a.size_ < 8 || b.size_ < 8) return a.view() < b.view();
+                return a.view().substr(8) < b.view().substr(8);
+            }
+            friend bool operator==(const PrefixString& a, const PrefixString& b)
+            {
+                return a.prefix_ == b.prefix_ && a.size_ == b.size_ &&
+                       (a.size_ <= 8 || a.view().substr(8) == b.view().substr(8));
+            }
+            friend bool operator!=(const PrefixString& a, const PrefixString& b) { return !(a == b); }
+
+        private:
+            friend struct KeyTraits<PrefixString>;
+
+            PrefixString(const PrefixString& key, const char* data): data_(data), size_(key.size_), prefix_(key.prefix_) {}
+
+            static std::uint64_t load_prefix(std::string_view str)
+            {
+                std::uint64_t prefix = 0;
+                size_t n = str.size() < 8 ? str.size() : 8;
+                for (size_t i = 0; i < 8; ++i)
+                    prefix = (prefix << 8) | (i < n ? static_cast<unsigned char>(str[i]) : 0u);
+                return prefix;
+            }
+
+            const char*   data_   = nullptr;
+            size_t        size_   = 0;
+            std::uint64_t prefix_ = 0;
+    };
+
+    // key bytes go to growing blocks owned by the tree; bytes of erased keys are given
+    // back only with the whole tree
+    template <>
+    struct KeyTraits<PrefixString>
+    {
+        public:
+            static constexpr bool owns_bytes = true;
+
+            KeyTraits() = default;
+            KeyTraits(const KeyTraits&) {}                   // the copy stores its own keys
+            KeyTraits& operator=(const KeyTraits&) = delete; // trees copy-and-swap instead
+            KeyTraits(KeyTraits&& other) noexcept: blocks_(std::move(other.blocks_)), cur_(other.cur_), end_(other.end_),
+                                                   last_(other.last_), bytes_(other.bytes_)
+            {
+                other.reset();
+            }
+            KeyTraits& operator=(KeyTraits&& other) noexcept // the source is left empty and reusable
+            {
+                if (this == &other) return *this;
+                blocks_ = std::move(other.blocks_);
+                cur_    = other.cur_;
+                end_    = other.end_;
+                last_   = other.last_;
+                bytes_  = other.bytes_;
+                other.reset();
+                return *this;
+            }
+
+            template <typename... Args>
+            PrefixString make(Args&&... args) { return store(PrefixString(std::forward<Args>(args)...)); }
+
+            size_t bytes() const { return bytes_; } // allocated for key bytes
+
+        private:
+            static constexpr size_t first_block_ = 4096;
+            static constexpr size_t max_block_   = size_t{1} << 20;
+
+            std::vector<std::unique_ptr<char[]>> blocks_;
+            char*  cur_   = nullptr;
+            char*  end_   = nullptr;
+            size_t last_  = 0; // size of the last regular block
+            size_t bytes_ = 0;
+
+            void reset()
+            {
+                blocks_.clear();
+                cur_  = end_ = nullptr;
+                last_ = bytes_ = 0;
+            }
+
+            PrefixString store(const PrefixString& key)
+            {
+                size_t n = key.size_;
+                if (!n) return PrefixString(key, nullptr);
+
+                if (static_cast<size_t>(end_ - cur_) < n)
+                {
+                    size_t capacity = last_ ? (last_ < max_block_ ? last_ * 2 : max_block_) : first_block_;
+                    if (n > capacity / 4) // a long key gets a block of its own
+                    {
+                        blocks_.reserve(blocks_.size() + 1);
+                        blocks_.emplace_back(new char[n]);
+                        bytes_ += n;
+                        std::memcpy(blocks_.back().get(), key.data_, n);
+                        return PrefixString(key, blocks_.back().get());
+                    }
+                    blocks_.reserve(blocks_.size() + 1);
+                    blocks_.emplace_back(new char[capacity]);
+                    bytes_ += capacity;
+                    last_   = capacity;
+                    cur_    = blocks_.back().get();
+                    end_    = cur_ + capacity;
+                }
+
+                std::memcpy(cur_, key.data_, n);
+                PrefixString stored(key, cur_);
+                cur_ += n;
+                return stored;
+            }
+    };
+
+}
@@ -1,73 +1,381 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <stdexcept>
 
+#include "Arena.hpp"
+#include "Balance.hpp"
+#include "Keys.hpp"
+
 namespace Trees {
 
-    template <typename KeyT, typename Comp = std::less<KeyT>>
+    // memory held by a tree, see SearchTree::memory_stats
+    struct MemoryStats
+    {
+        size_t blocks         = 0;
+        size_t nodes          = 0; // live nodes (distinct keys)
+        size_t node_size      = 0; // sizeof(Node)
+        size_t bytes_reserved = 0; // node blocks as allocated by the arena
+        size_t bytes_used     = 0; // live nodes
+        size_t key_bytes      = 0; // out-of-node key storage owned by the tree (KeyTraits)
+        size_t buffer_bytes   = 0; // write buffer capacity
+
+        size_t total_bytes()    const { return bytes_reserved + key_bytes + buffer_bytes; }
+        double utilization()    const { return bytes_reserved ? double(bytes_used) / double(bytes_reserved) : 0.0; }
+        double bytes_per_node() const { return nodes ? double(total_bytes()) / double(nodes) : 0.0; }
+    };
+
+    // shape of a tree, see SearchTree::shape_stats
+    struct ShapeStats
+    {
+        int                 height = 0;          // levels, 0 - empty
+        std::vector<size_t> depth_histogram;     // nodes per depth, the root is depth 0
+        double              average_path = 0.0;  // nodes visited by a search for a stored key
+
+        // distinct 64-byte cache lines touched on the way from the root to a leaf
+        double              average_path_lines = 0.0;
+        size_t              max_path_lines     = 0;
+    };
+
+    // range_query answers served by the query cache, see SearchTree::set_query_cache
+    struct QueryCacheStats
+    {
+        long long hits     = 0; // answered from the cache, adjusted ones included
+        long long adjusted = 0; // stale entries brought up to date from the change log
+        long long misses   = 0; // answered by the tree
+
+        double hit_rate() const { return hits + misses ? double(hits) / double(hits + misses) : 0.0; }
+    };
+
+    // Multi == true keeps a multiplicity per node instead of dropping duplicate keys,
+    // Balance is one of the policies from Balance.hpp, Arena one of Arena.hpp;
+    // keys are built by KeyTraits<KeyT> (Keys.hpp)
+    template <typename KeyT, typename Comp = std::less<KeyT>, bool Multi = false,
+              typename Balance = AvlBalance, typename Arena = HeapArena>
     class SearchTree {
         private:
-            struct Node
+            friend Balance;
+
+            // arithmetic keys under std::less: the descent loops compare with a plain <
+            // and index child_ with the comparison result instead of branching on it
+            static constexpr bool plain_keys_ = std::is_arithmetic_v<KeyT> &&
+                (std::is_same_v<Comp, std::less<KeyT>> || std::is_same_v<Comp, std::less<>>);
+
+            // count_ (multiplicity of key_) is stored only in multi mode, set-mode nodes
+            // go without it and multiplicity() is a constant 1
+            struct Generic_Node
+            {
+                KeyT key_;
+                Generic_Node *child_[2] = {nullptr, nullptr}; // left, right
+                Generic_Node *parent_ = nullptr;
+                int  height_  = 1; // balance metadata, owned by the Balance policy
+                int  size_    = 1; // total multiplicity of the subtree
+
+                Generic_Node*& left()  { return child_[0]; }
+                Generic_Node*& right() { return child_[1]; }
+            };
+
+            struct Generic_Multi_Node
             {
                 KeyT key_;
-                Node *left_   = nullptr;
-                Node *right_  = nullptr;
-                Node *parent_ = nullptr;
+                Generic_Multi_Node *child_[2] = {nullptr, nullptr}; // left, right
+                Generic_Multi_Node *parent_ = nullptr;
                 int  height_  = 1;
                 int  size_    = 1;
+                int  count_   = 1;
+
+                Generic_Multi_Node*& left()  { return child_[0]; }
+                Generic_Multi_Node*& right() { return child_[1]; }
+            };
+
+            // same fields, the ones the descent loops read come first and parent_ (insert/erase
+            // only) last; height_ fills the padding after size_. 40 bytes for 4- and 8-byte keys
+            struct Hot_Node
+            {
+                KeyT      key_;
+                int       size_   = 1;
+                int       height_ = 1;
+                Hot_Node *child_[2] = {nullptr, nullptr}; // left, right
+                Hot_Node *parent_ = nullptr;
+
+                Hot_Node*& left()  { return child_[0]; }
+                Hot_Node*& right() { return child_[1]; }
+            };
+
+            // 40 bytes instead of 48 for 4-byte keys
+            struct Hot_Multi_Node
+            {
+                KeyT            key_;
+                int             size_   = 1;
+                Hot_Multi_Node *child_[2] = {nullptr, nullptr}; // left, right
+                int             count_  = 1;
+                int             height_ = 1;
+                Hot_Multi_Node *parent_ = nullptr;
+
+                Hot_Multi_Node*& left()  { return child_[0]; }
+                Hot_Multi_Node*& right() { return child_[1]; }
             };
 
+            using Node     = std::conditional_t<plain_keys_, std::conditional_t<Multi, Hot_Multi_Node, Hot_Node>,
+                                                             std::conditional_t<Multi, Generic_Multi_Node, Generic_Node>>;
             using iterator = Node *;
 
             iterator top_     = nullptr; // root tree;
             Comp     cmp_; // comparator
+            Balance  balance_;
+
+            // finger: last inserted node and its in-order neighbours (nullptr - none);
+            // rotations keep the in-order, so the gaps around it stay valid until an erase
+            iterator finger_      = nullptr;
+            iterator finger_prev_ = nullptr;
+            iterator finger_next_ = nullptr;
 
             struct Block_Memory
             {
                 iterator begin_ = nullptr;
                 iterator cur_   = nullptr;
                 iterator end_   = nullptr; // after past
+                size_t   bytes_ = 0;       // as returned by the arena
             };
 
+            Arena                     arena_;
             std::vector<Block_Memory> mem_blocks_;
+            size_t                    fill_block_ = 0; // new nodes go here; blocks after it are reserved, still empty
+            KeyTraits<KeyT>           keys_;
+
+            // a key that is already built by keys_ (write buffer), moved into the node as is
+            struct Stored_Key { KeyT& key_; };
+
+            // write buffer: keys not merged into the tree yet (set mode: not repeated, but
+            // may repeat a tree key). [0, buffer_sorted_) is sorted, the short tail is merged
+            // into it every buffer_tail_ inserts; the whole buffer goes into the tree in one
+            // sorted pass when it reaches buffer_limit_
+            static constexpr size_t buffer_tail_ = 32;
+
+            // set mode: whether the key is in the tree is looked up by the first query that
+            // needs it, at most once - the tree part changes only after a flush
+            struct Buffered_Key
+            {
+                KeyT         key_;
+                mutable bool checked_ = false;
+                mutable bool in_tree_ = false; // counted in the tree, dropped by the flush
+            };
+
+            std::vector<Buffered_Key>  buffer_;
+            std::vector<Buffered_Key>  buffer_scratch_;      // the tail while it is merged
+            size_t                     buffer_sorted_  = 0;
+            size_t                     buffer_limit_   = 0; // 0 - inserts go straight to the tree
+            mutable size_t             buffer_checked_ = 0;
+            mutable size_t             buffer_repeats_ = 0; // checked keys found in the tree
+
+            OpCounters counters_;
+
+            // query cache: open-addressed slots of range_query(a, b) answers tagged with
+            // version_, which every change of the contents bumps while the cache is on. The
+            // last change_log_ changes are kept in a ring, so an entry a few changes old is
+            // brought up to date by the ones that fall into [a, b] instead of a descent
+            struct Cache_Entry
+            {
+                KeyT          a_;
+                KeyT          b_;
+                int           answer_  = 0;
+                std::uint64_t version_ = 0;
+                bool          used_    = false;
+            };
+
+            struct Cache_Change
+            {
+                KeyT key_;
+                int  delta_; // change of count(key_)
+            };
+
+            static constexpr bool cacheable_keys_ = !KeyTraits<KeyT>::owns_bytes &&
+                std::is_default_constructible_v<KeyT> && std::is_default_constructible_v<std::hash<KeyT>>;
+
+            static constexpr size_t cache_window_ = 4;  // slots probed for a pair
+            static constexpr size_t change_log_   = 64;
+
+            mutable std::vector<Cache_Entry> cache_;   // empty - off, otherwise a power of two
+            std::vector<Cache_Change>        changes_; // changes_[v % change_log_] made version v + 1
+            std::uint64_t                    version_ = 0;
+            mutable QueryCacheStats          cache_stats_;
+
+        private:
+            template <typename C, typename = void>
+            struct is_transparent : std::false_type {};
+            template <typename C>
+            struct is_transparent<C, std::void_t<typename C::is_transparent>> : std::true_type {};
+
+            // K can be compared with the stored keys as is: KeyT itself or, with a
+            // transparent Comp (std::less<> etc.), anything Comp accepts next to KeyT
+            template <typename K>
+            static constexpr bool lookup_key_v =
+                std::is_same_v<std::decay_t<K>, KeyT> ||
+                (is_transparent<Comp>::value &&
+                 std::is_invocable_r_v<bool, const Comp&, const KeyT&, const K&> &&
+                 std::is_invocable_r_v<bool, const Comp&, const K&, const KeyT&>);
 
         public: // modifiers
-            void    insert(const KeyT& key);
+            void    insert(const KeyT& key) { insert(key, 1); }
+            void    insert(KeyT&& key)      { insert_key(std::move(key)); } // moved into the node
+            void    insert(const KeyT& key, int n); // n copies of key (set mode stores one)
+            // the key is built from args right in the node (or the write buffer), and only
+            // when it is not a duplicate; a single lookup key argument is compared as is
+            template <typename... Args>
+            void    emplace(Args&&... args);
+            iterator insert(iterator hint, const KeyT& key); // std::set-like hint, nullptr - end
+            bool    erase_one(const KeyT& key);     // remove one occurrence, false if absent
+
+            // node selectors (lower_bound, upper_bound, distance) only see merged keys,
+            // range_query, count and size also count the write buffer
+            void    set_write_buffer(size_t limit); // 0 disables buffering
+            void    flush();                        // merge the write buffer into the tree
+
+        public: // snapshots, KeyT must be trivially copyable; the file is tied to the
+                // platform (sizeof/endianness), KeyT, Multi and Balance
+            void    save(const std::string& path);  // merges the write buffer first
+            void    load(const std::string& path);  // replaces the contents
+
+        private: // snapshot format: header + nodes in BFS order, links are node indices
+            struct Snapshot_Header
+            {
+                char          magic_[8];
+                char          balance_[8];
+                std::uint32_t key_size_;
+                std::uint32_t multi_;
+                std::uint64_t nodes_;
+            };
 
-        private: // Insertion helpers
-            iterator bst_insert(const KeyT& key); // standard insert in binary search tree
+            struct Snapshot_Node
+            {
+                KeyT         key_;
+                std::int64_t left_;   // -1 - nullptr
+                std::int64_t right_;
+                std::int64_t parent_;
+                int          height_;
+                int          size_;
+                int          count_;
+            };
+
+            static constexpr char snapshot_magic_[8] = {'T','R','E','E','S','N','P','1'};
+            static void  fill_header(Snapshot_Header& header, std::uint64_t nodes);
+
+        private: // Insertion helpers; key is the lookup key, args build the node key
+            template <typename K>
+            void     insert_key(K&& key);
+            // the node whose count changed, nullptr - a duplicate in set mode
+            template <typename K, typename... Args>
+            iterator tree_insert(const K& key, int n, Args&&... args);
+            template <typename K>
+            void     buffer_insert(K&& key);
+            void     merge_buffer_tail();
+            // standard insert in binary search tree; on return size_ of every ancestor includes n
+            template <typename K, typename... Args>
+            iterator bst_insert(const K& key, int n, bool& inserted, Args&&... args);
+            template <typename... Args>
+            iterator link_into_gap(iterator prev, iterator next, int n, Args&&... args); // prev < key < next
+            void     add_to_path(iterator node, int delta);        // size_ += delta from node up to root
+            void     reset_finger() { finger_ = finger_prev_ = finger_next_ = nullptr; }
+
+        private: // Erase helpers
+            void     remove_node(iterator node);
 
         private: // Balancing
-            int            node_height(iterator node) const { return node ? node->height_ : 0; }
             int            node_size(iterator node) const { return node ? node->size_ : 0; }
-            inline void    update_metric(iterator root);
+            static int     multiplicity(iterator node) // of node->key_, not null
+            {
+                if constexpr (Multi) return node->count_;
+                else                 return 1;
+            }
+            inline void    update_size(iterator root);
 
-            iterator rotate_left(iterator root);
+            iterator rotate_left(iterator root);  // keep size_, height_ is up to the policy
             iterator rotate_right(iterator root);
 
-            iterator balance(iterator root, int bf);
-            void     rebalance(iterator root);
-            int      balance_factor(iterator current_root) const;
-
         private: // distance helpers
 
-            int      count_before(const KeyT& key) const; // count elements less than key
-
-        public: // selectors
-
-            iterator lower_bound(const KeyT& key) const; // first not less than key
-            iterator upper_bound(const KeyT& key) const; // first greater then key
+            template <typename K>
+            int      count_before(const K& key) const; // count elements less than key
+            template <typename K>
+            int      buffer_count(const K& a, const K& b) const; // buffered keys in [a, b]
+            bool     buffer_repeat(const Buffered_Key& entry) const;
+            template <typename K>
+            bool     in_tree(const K& key) const;
+
+            template <typename K> iterator lower_bound_of(const K& key) const;
+            template <typename K> iterator upper_bound_of(const K& key) const;
+            template <typename K> int      range_query_of(const K& a, const K& b) const;
+            template <typename K> int      count_of(const K& key) const;
+
+            void     note_change(const KeyT& key, int delta);
+            void     clear_query_cache();
+            int      cached_range_query(const KeyT& a, const KeyT& b) const;
+            bool     catch_up(Cache_Entry& entry) const; // false - the entry has to be recomputed
+
+        public: // selectors; with a transparent Comp they also take other comparable types
+                // (std::string_view for std::string keys) without building a KeyT
+
+            iterator lower_bound(const KeyT& key) const { return lower_bound_of(key); } // first not less than key
+            iterator upper_bound(const KeyT& key) const { return upper_bound_of(key); } // first greater then key
+            iterator predecessor(iterator node) const;   // nullptr node - last element
             int      distance(iterator fst,iterator snd) const;
-            int      range_query(const KeyT& a,const KeyT& b) const;
+            int      range_query(const KeyT& a,const KeyT& b) const
+            {
+                if constexpr (cacheable_keys_)
+                    if (!cache_.empty()) return cached_range_query(a, b);
+                return range_query_of(a, b);
+            }
+            int      count(const KeyT& key) const { return count_of(key); } // multiplicity of key
+            int      size() const;
+
+            template <typename K, typename C = Comp, typename = typename C::is_transparent>
+            iterator lower_bound(const K& key) const { return lower_bound_of(key); }
+            template <typename K, typename C = Comp, typename = typename C::is_transparent>
+            iterator upper_bound(const K& key) const { return upper_bound_of(key); }
+            template <typename K, typename C = Comp, typename = typename C::is_transparent>
+            int      range_query(const K& a, const K& b) const { return range_query_of(a, b); }
+            template <typename K, typename C = Comp, typename = typename C::is_transparent>
+            int      count(const K& key) const { return count_of(key); }
+            size_t   node_count() const; // distinct keys in the tree (without the write buffer)
 
         private: // memory management
-            void     add_block();
-            iterator get_node(const KeyT& key);
+            void     add_block(size_t capacity = 0); // 0 - arena_.next_capacity
+            size_t   node_capacity() const; // live nodes plus the free slots new nodes go to
+            template <typename... Args>
+            iterator get_node(Args&&... args); // keys_.make(args...) in the next free slot
+            iterator get_node(Stored_Key stored);
+            iterator next_slot();
+            void     release_node(iterator node); // fills the hole with the last allocated node
             void     destroy_blocks_memory();
 
-            iterator clone_subtree(iterator origin, iterator parent);
+            // copies are laid out in van Emde Boas order in one block of exactly node_count()
+            // nodes; big trees with nothrow-copyable keys are copied by several threads
+            static constexpr size_t parallel_copy_threshold_ = size_t{1} << 16;
+
+            struct Pending_Copy
+            {
+                iterator origin_;
+                iterator parent_; // copy to link to, nullptr for the root
+                bool     left_;
+            };
+
+            void     clone_tree(const SearchTree& other_tree);
+            void     clone_parallel(iterator origin_root, size_t nodes, iterator dst);
+            size_t        clone_veb(const Pending_Copy& root, size_t nodes, iterator dst, iterator* end);
+            void          veb_levels(const Pending_Copy& root, int levels, iterator dst, size_t& pos,
+                                     iterator* end, std::vector<Pending_Copy>& below);
+            static int    veb_depth(size_t nodes);
+            static size_t subtree_nodes(iterator origin);
 
         public:
             SearchTree() = default;
@@ -81,15 +389,48 @@ namespace Trees {
         public: // for unit test method
             iterator root() const { return top_; }
 
+        public: // arena
+            Arena&   arena() { return arena_; } // growth settings apply to the next blocks
+            void     reserve(size_t n);         // room for n nodes without further allocations
+            const OpCounters& counters() const { return counters_; }
+
+        public: // introspection, both walk the whole tree or block list
+            MemoryStats memory_stats() const;
+            ShapeStats  shape_stats()  const;
+            static constexpr size_t cache_line_ = 64;
+
+        public: // query cache for repeated range_query(a, b) with KeyT bounds; needs std::hash<KeyT>
+                // and keys kept in the node. With the cache on range_query writes to it, so
+                // concurrent range_query calls on one tree need outside locking
+            void     set_query_cache(size_t slots); // rounded up to a power of two, 0 - off
+            const QueryCacheStats& query_cache_stats() const { return cache_stats_; }
+
     };
 
+    template <typename KeyT, typename Comp = std::less<KeyT>, typename Balance = AvlBalance, typename Arena = HeapArena>
+    using MultiSearchTree = SearchTree<KeyT, Comp, true, Balance, Arena>;
+
 //-----------------------------------------------------------------------------------------------------
 //--------------------------- The Rule of Five -------------------------------------------------------
-    template <typename KeyT, typename Comp>
-    SearchTree<KeyT, Comp>::SearchTree(const SearchTree& other_tree): top_(nullptr), cmp_(other_tree.cmp_)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::SearchTree(const SearchTree& other_tree): top_(nullptr), cmp_(other_tree.cmp_),
+                                                                          balance_(other_tree.balance_),
+                                                                          arena_(other_tree.arena_),
+                                                                          keys_(other_tree.keys_),
+                                                                          buffer_(other_tree.buffer_),
+                                                                          buffer_sorted_(other_tree.buffer_sorted_),
+                                                                          buffer_limit_(other_tree.buffer_limit_),
+                                                                          buffer_checked_(other_tree.buffer_checked_),
+                                                                          buffer_repeats_(other_tree.buffer_repeats_),
+                                                                          cache_(other_tree.cache_),
+                                                                          changes_(other_tree.changes_),
+                                                                          version_(other_tree.version_)
     {
+        if constexpr (KeyTraits<KeyT>::owns_bytes)
+            for (Buffered_Key& entry : buffer_) entry.key_ = keys_.make(entry.key_);
+
         try {
-            top_ = clone_subtree(other_tree.top_,nullptr);
+            clone_tree(other_tree);
         }
         catch (...) {
             destroy_blocks_memory();
@@ -97,16 +438,16 @@ namespace Trees {
         }
     }
 //-----------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp>
-    SearchTree<KeyT, Comp>::~SearchTree()
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::~SearchTree()
     {
         destroy_blocks_memory();
         top_ = nullptr;
     }
 
 //-----------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp>
-    SearchTree<KeyT, Comp>& SearchTree<KeyT, Comp>::operator=(const SearchTree& other_tree)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>& SearchTree<KeyT, Comp, Multi, Balance, Arena>::operator=(const SearchTree& other_tree)
     {
         if (this == &other_tree) return *this;
 
@@ -114,31 +455,94 @@ namespace Trees {
 
         std::swap(top_,       tmp.top_);
         std::swap(cmp_,       tmp.cmp_);
+        std::swap(balance_,   tmp.balance_);
+        std::swap(arena_,     tmp.arena_);
         std::swap(mem_blocks_,tmp.mem_blocks_);
+        std::swap(fill_block_,tmp.fill_block_);
+        std::swap(keys_,      tmp.keys_);
+        std::swap(buffer_,    tmp.buffer_);
+        std::swap(buffer_sorted_, tmp.buffer_sorted_);
+        std::swap(buffer_limit_, tmp.buffer_limit_);
+        std::swap(buffer_checked_, tmp.buffer_checked_);
+        std::swap(buffer_repeats_, tmp.buffer_repeats_);
+        std::swap(cache_,     tmp.cache_);
+        std::swap(changes_,   tmp.changes_);
+        std::swap(version_,   tmp.version_);
+        cache_stats_ = QueryCacheStats{};
+        reset_finger();
 
         return *this;
     }
 
 //-----------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp>
-    SearchTree<KeyT, Comp>::SearchTree(SearchTree&& other_tree): top_(other_tree.top_), cmp_(std::move(other_tree.cmp_)),
-                                                                 mem_blocks_(std::move(other_tree.mem_blocks_))
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::SearchTree(SearchTree&& other_tree): top_(other_tree.top_), cmp_(std::move(other_tree.cmp_)),
+                                                                 balance_(std::move(other_tree.balance_)),
+                                                                 arena_(std::move(other_tree.arena_)),
+                                                                 mem_blocks_(std::move(other_tree.mem_blocks_)),
+                                                                 fill_block_(other_tree.fill_block_),
+                                                                 keys_(std::move(other_tree.keys_)),
+                                                                 buffer_(std::move(other_tree.buffer_)),
+                                                                 buffer_sorted_(other_tree.buffer_sorted_),
+                                                                 buffer_limit_(other_tree.buffer_limit_),
+                                                                 buffer_checked_(other_tree.buffer_checked_),
+                                                                 buffer_repeats_(other_tree.buffer_repeats_),
+                                                                 cache_(std::move(other_tree.cache_)),
+                                                                 changes_(std::move(other_tree.changes_)),
+                                                                 version_(other_tree.version_),
+                                                                 cache_stats_(other_tree.cache_stats_)
     {
+        finger_      = other_tree.finger_;
+        finger_prev_ = other_tree.finger_prev_;
+        finger_next_ = other_tree.finger_next_;
+
         other_tree.top_ = nullptr;
+        other_tree.reset_finger();
+        other_tree.buffer_.clear();
+        other_tree.buffer_sorted_  = 0;
+        other_tree.buffer_checked_ = 0;
+        other_tree.buffer_repeats_ = 0;
+        other_tree.fill_block_    = 0;
+        other_tree.cache_.clear();
+        other_tree.changes_.clear();
     }
 
 //-----------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp>
-    SearchTree<KeyT, Comp>& SearchTree<KeyT, Comp>::operator=(SearchTree&& other_tree)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>& SearchTree<KeyT, Comp, Multi, Balance, Arena>::operator=(SearchTree&& other_tree)
     {
         if (this == &other_tree) return *this;
 
         destroy_blocks_memory();
         top_             = other_tree.top_;
         cmp_             = std::move(other_tree.cmp_);
+        balance_         = std::move(other_tree.balance_);
+        arena_           = std::move(other_tree.arena_);
         mem_blocks_      = std::move(other_tree.mem_blocks_);
+        fill_block_      = other_tree.fill_block_;
+        keys_            = std::move(other_tree.keys_);
+        buffer_          = std::move(other_tree.buffer_);
+        buffer_sorted_   = other_tree.buffer_sorted_;
+        buffer_limit_    = other_tree.buffer_limit_;
+        buffer_checked_  = other_tree.buffer_checked_;
+        buffer_repeats_  = other_tree.buffer_repeats_;
+        finger_          = other_tree.finger_;
+        finger_prev_     = other_tree.finger_prev_;
+        finger_next_     = other_tree.finger_next_;
+        cache_           = std::move(other_tree.cache_);
+        changes_         = std::move(other_tree.changes_);
+        version_         = other_tree.version_;
+        cache_stats_     = other_tree.cache_stats_;
 
         other_tree.top_  = nullptr;
+        other_tree.reset_finger();
+        other_tree.buffer_.clear();
+        other_tree.buffer_sorted_  = 0;
+        other_tree.buffer_checked_ = 0;
+        other_tree.buffer_repeats_ = 0;
+        other_tree.fill_block_    = 0;
+        other_tree.cache_.clear();
+        other_tree.changes_.clear();
 
         return *this;
 
@@ -147,83 +551,391 @@ namespace Trees {
 //-----------------------------------------------------------------------------------------------------
 //--------------------------- Memory management -------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp>
-    void SearchTree<KeyT, Comp>::add_block()
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::add_block(size_t capacity)
     {
         size_t prev_capacity = mem_blocks_.empty() ? 0: static_cast<size_t> (mem_blocks_.back().end_ - mem_blocks_.back().begin_);
-        size_t new_capacity  = prev_capacity ? prev_capacity*2: 512;
+        size_t new_capacity  = capacity ? capacity : arena_.next_capacity(prev_capacity);
+        size_t bytes         = new_capacity * sizeof(Node);
 
-        iterator new_mem   = static_cast<iterator> (::operator new[](new_capacity * sizeof(Node)));
-        mem_blocks_.push_back(Block_Memory{new_mem,new_mem,new_mem+new_capacity});
+        mem_blocks_.reserve(mem_blocks_.size() + 1);
+        iterator new_mem   = static_cast<iterator> (arena_.allocate(bytes, alignof(Node)));
+        new_capacity       = bytes / sizeof(Node); // the arena may round the block up
+        mem_blocks_.push_back(Block_Memory{new_mem,new_mem,new_mem+new_capacity,bytes});
     }
 
-    template <typename KeyT, typename Comp >
-    typename SearchTree<KeyT, Comp>::iterator
-    SearchTree<KeyT, Comp>::get_node(const KeyT& key)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::next_slot()
     {
-        if (mem_blocks_.empty() || (mem_blocks_.back().cur_ == mem_blocks_.back().end_)) add_block();
+        while (fill_block_ < mem_blocks_.size() && mem_blocks_[fill_block_].cur_ == mem_blocks_[fill_block_].end_)
+            ++fill_block_;
+        if (fill_block_ == mem_blocks_.size()) add_block();
+        return mem_blocks_[fill_block_].cur_;
+    }
 
-        Block_Memory& last_block = mem_blocks_.back();
-        iterator cur_node        = last_block.cur_;
-        ::new (cur_node) Node{key};
-        last_block.cur_++; // after memory allocation
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename... Args>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::get_node(Args&&... args)
+    {
+        iterator cur_node = next_slot();
+        ::new (cur_node) Node{keys_.make(std::forward<Args>(args)...)}; // no temporary in C++17
+        mem_blocks_[fill_block_].cur_++; // after memory allocation
+        return cur_node;
+    }
+
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::get_node(Stored_Key stored)
+    {
+        iterator cur_node = next_slot();
+        ::new (cur_node) Node{std::move(stored.key_)};
+        mem_blocks_[fill_block_].cur_++;
         return cur_node;
     }
 
 
-    template <typename KeyT, typename Comp>
-    void SearchTree<KeyT, Comp>::destroy_blocks_memory()
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::destroy_blocks_memory()
     {
         for (auto& m_b :mem_blocks_)
         {
             for (iterator it = m_b.begin_; it != m_b.cur_;++it)
                 it->~Node();
-            ::operator delete[](m_b.begin_);
+            arena_.deallocate(m_b.begin_, m_b.bytes_, alignof(Node));
         }
         mem_blocks_.clear();
+        fill_block_ = 0;
     }
 
-    template <typename KeyT, typename Comp >
-    typename SearchTree<KeyT, Comp>::iterator
-    SearchTree<KeyT, Comp>::clone_subtree(iterator origin,iterator parent)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::reserve(size_t n)
+    {
+        size_t capacity = node_capacity();
+        if (capacity >= n) return;
+
+        add_block(n - capacity); // one block, not limited by the growth settings
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    size_t SearchTree<KeyT, Comp, Multi, Balance, Arena>::node_capacity() const
     {
-        if (!origin)   return nullptr;
+        size_t used = 0;
+        for (const auto& m_b : mem_blocks_) used += static_cast<size_t>(m_b.cur_ - m_b.begin_);
 
-        iterator node = get_node(origin->key_);
-        node->parent_ = parent;
-        node->height_ = origin->height_;
-        node->size_   = origin->size_;
+        size_t room = 0; // free slots still to be filled, the current block's included
+        for (size_t i = fill_block_; i < mem_blocks_.size(); ++i)
+            room += static_cast<size_t>(mem_blocks_[i].end_ - mem_blocks_[i].cur_);
+        return used + room;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::release_node(iterator node)
+    {
+        // node is already unlinked from the tree; keep the arena dense by moving
+        // the most recently allocated node into its slot
+        auto src_block = mem_blocks_.end() - 1;
+        while (src_block->cur_ == src_block->begin_) --src_block;
 
-        node->left_   = clone_subtree(origin->left_, node);
-        node->right_  = clone_subtree(origin->right_, node);
+        iterator last = src_block->cur_ - 1;
+        if (last != node)
+        {
+            node->~Node();
+            ::new (node) Node(std::move(*last));
 
-        return node;
+            if (!node->parent_)                     top_ = node;
+            else if (node->parent_->left() == last)  node->parent_->left()  = node;
+            else                                    node->parent_->right() = node;
 
+            if (node->left())  node->left()->parent_  = node;
+            if (node->right()) node->right()->parent_ = node;
+        }
+        last->~Node();
+        src_block->cur_--;
     }
 
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    size_t SearchTree<KeyT, Comp, Multi, Balance, Arena>::node_count() const
+    {
+        // release_node keeps every block dense, so live nodes are exactly [begin_, cur_)
+        size_t used = 0;
+        for (const auto& m_b : mem_blocks_) used += static_cast<size_t>(m_b.cur_ - m_b.begin_);
+        return used;
+    }
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Introspection -----------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    MemoryStats SearchTree<KeyT, Comp, Multi, Balance, Arena>::memory_stats() const
+    {
+        MemoryStats stats;
+        stats.blocks     = mem_blocks_.size();
+        stats.nodes      = node_count();
+        stats.node_size  = sizeof(Node);
+        stats.bytes_used = stats.nodes * sizeof(Node);
+        for (const auto& m_b : mem_blocks_) stats.bytes_reserved += m_b.bytes_;
+
+        if constexpr (KeyTraits<KeyT>::owns_bytes) stats.key_bytes = keys_.bytes();
+        stats.buffer_bytes = (buffer_.capacity() + buffer_scratch_.capacity()) * sizeof(Buffered_Key);
+        return stats;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    ShapeStats SearchTree<KeyT, Comp, Multi, Balance, Arena>::shape_stats() const
+    {
+        ShapeStats stats;
+        if (!top_) return stats;
+
+        struct Visit
+        {
+            iterator node;
+            size_t   depth;
+        };
+
+        // preorder: when a node is visited, path_*[0, depth) still describe its ancestors
+        std::vector<Visit>     stack{Visit{top_, 0}};
+        std::vector<std::uintptr_t> path_first, path_last; // cache lines covered by each node on the path
+        std::vector<size_t>    path_lines;            // distinct lines from the root down to the node
 
+        size_t nodes       = 0;
+        size_t depth_sum   = 0;
+        size_t leaves      = 0;
+        size_t leaf_lines  = 0;
+
+        while (!stack.empty())
+        {
+            auto [node, depth] = stack.back();
+            stack.pop_back();
+
+            if (stats.depth_histogram.size() <= depth) stats.depth_histogram.resize(depth + 1);
+            stats.depth_histogram[depth]++;
+            nodes++;
+            depth_sum += depth + 1;
+
+            std::uintptr_t first = reinterpret_cast<std::uintptr_t>(node) / cache_line_;
+            std::uintptr_t last  = (reinterpret_cast<std::uintptr_t>(node) + sizeof(Node) - 1) / cache_line_;
+            size_t lines    = depth ? path_lines[depth - 1] : 0;
+            for (std::uintptr_t line = first; line <= last; ++line)
+            {
+                bool seen = false;
+                for (size_t d = 0; d < depth && !seen; ++d)
+                    seen = path_first[d] <= line && line <= path_last[d];
+                lines += !seen;
+            }
+
+            if (path_lines.size() <= depth)
+            {
+                path_first.resize(depth + 1);
+                path_last.resize(depth + 1);
+                path_lines.resize(depth + 1);
+            }
+            path_first[depth] = first;
+            path_last[depth]  = last;
+            path_lines[depth] = lines;
+
+            if (!node->left() && !node->right())
+            {
+                leaves++;
+                leaf_lines += lines;
+                if (lines > stats.max_path_lines) stats.max_path_lines = lines;
+            }
+            if (node->right()) stack.push_back(Visit{node->right(), depth + 1});
+            if (node->left())  stack.push_back(Visit{node->left(),  depth + 1});
+        }
+
+        stats.height             = static_cast<int>(stats.depth_histogram.size());
+        stats.average_path       = double(depth_sum) / double(nodes);
+        stats.average_path_lines = double(leaf_lines) / double(leaves);
+        return stats;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::clone_tree(const SearchTree& other_tree)
+    {
+        size_t n = other_tree.node_count();
+        if (!n) return;
+
+        add_block(n);
+        Block_Memory& block = mem_blocks_.back();
+
+        // keys_ is not shared between threads: traits owning key bytes copy sequentially
+        if constexpr (std::is_nothrow_copy_constructible_v<KeyT> && !KeyTraits<KeyT>::owns_bytes)
+        {
+            if (n >= parallel_copy_threshold_ && std::thread::hardware_concurrency() > 1)
+            {
+                clone_parallel(other_tree.top_, n, block.begin_);
+                block.cur_ = block.begin_ + n;
+                top_       = block.begin_;
+                return;
+            }
+        }
+
+        clone_veb(Pending_Copy{other_tree.top_, nullptr, true}, n, block.begin_, &block.cur_);
+        top_ = block.begin_;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    int SearchTree<KeyT, Comp, Multi, Balance, Arena>::veb_depth(size_t nodes)
+    {
+        // height of a perfect tree of that many nodes; deeper nodes get another round in
+        // clone_veb. Not size_: in Multi mode it counts every copy of a key
+        int levels = 1;
+        while ((size_t{1} << levels) <= nodes) ++levels;
+        return levels;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    size_t SearchTree<KeyT, Comp, Multi, Balance, Arena>::clone_veb(const Pending_Copy& root, size_t nodes, iterator dst, iterator* end)
+    {
+        int levels = veb_depth(nodes);
+        size_t pos = 0;
+
+        std::vector<Pending_Copy> below, next;
+        veb_levels(root, levels, dst, pos, end, below);
+        while (!below.empty())
+        {
+            next.clear();
+            for (const Pending_Copy& sub : below) veb_levels(sub, levels, dst, pos, end, next);
+            below.swap(next);
+        }
+        return pos;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::veb_levels(const Pending_Copy& root, int levels, iterator dst,
+                                                                   size_t& pos, iterator* end,
+                                                                   std::vector<Pending_Copy>& below)
+    {
+        // copies the first `levels` levels under root.origin_: the upper half of them
+        // first, then each subtree hanging off it; children one level deeper go to below.
+        // The recursion is over levels, so its depth is O(log log n)
+        if (levels == 1)
+        {
+            iterator from = root.origin_;
+            iterator at   = dst + pos++;
+            ::new (at) Node{keys_.make(from->key_)};
+            at->parent_ = root.parent_;
+            at->height_ = from->height_;
+            at->size_   = from->size_;
+            if constexpr (Multi) at->count_ = from->count_;
+            if (root.parent_) (root.left_ ? root.parent_->left() : root.parent_->right()) = at;
+            if (end) *end = at + 1; // constructed prefix, for cleanup on exceptions
+
+            if (from->left())  below.push_back(Pending_Copy{from->left(),  at, true});
+            if (from->right()) below.push_back(Pending_Copy{from->right(), at, false});
+            return;
+        }
+
+        int top     = levels / 2;
+        size_t mark = below.size();
+        veb_levels(root, top, dst, pos, end, below);
+
+        size_t stop = below.size();
+        for (size_t i = mark; i < stop; ++i)
+        {
+            Pending_Copy sub = below[i]; // below grows in the call
+            veb_levels(sub, levels - top, dst, pos, end, below);
+        }
+        below.erase(below.begin() + mark, below.begin() + stop);
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    size_t SearchTree<KeyT, Comp, Multi, Balance, Arena>::subtree_nodes(iterator origin)
+    {
+        if constexpr (!Multi) return static_cast<size_t>(origin->size_);
+
+        size_t counter = 0;
+        std::vector<iterator> stack{origin};
+        while (!stack.empty())
+        {
+            iterator node = stack.back();
+            stack.pop_back();
+            ++counter;
+            if (node->left())  stack.push_back(node->left());
+            if (node->right()) stack.push_back(node->right());
+        }
+        return counter;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::clone_parallel(iterator origin_root, size_t nodes, iterator dst)
+    {
+        // the upper half of the levels is copied here; every subtree below it is a
+        // contiguous region of the vEB layout and becomes one task
+        size_t top_nodes = 0;
+        std::vector<Pending_Copy> frontier;
+        veb_levels(Pending_Copy{origin_root, nullptr, true}, veb_depth(nodes) / 2,
+                   dst, top_nodes, nullptr, frontier);
+
+        unsigned threads = std::thread::hardware_concurrency();
+        std::atomic<size_t> next_task{0};
+        auto run_tasks = [&](auto&& task)
+        {
+            auto worker = [&]()
+            {
+                for (size_t k = next_task++; k < frontier.size(); k = next_task++) task(k);
+            };
+
+            std::vector<std::thread> pool;
+            try {
+                for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+            }
+            catch (...) {} // fewer threads, the calling thread picks up the rest
+            worker();
+            for (auto& th : pool) th.join();
+            next_task = 0;
+        };
+
+        std::vector<size_t> offset(frontier.size() + 1);
+        run_tasks([&](size_t k) { offset[k + 1] = subtree_nodes(frontier[k].origin_); });
+
+        offset[0] = top_nodes;
+        for (size_t k = 0; k < frontier.size(); ++k) offset[k + 1] += offset[k];
+
+        run_tasks([&](size_t k) { clone_veb(frontier[k], offset[k + 1] - offset[k], dst + offset[k], nullptr); });
+    }
 //-----------------------------------------------------------------------------------------------------
 //--------------------------- Distance helpers  -------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------
 
-    template <typename KeyT, typename Comp >
-    int SearchTree<KeyT,Comp>::count_before(const KeyT& key) const
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    int SearchTree<KeyT, Comp, Multi, Balance, Arena>::count_before(const K& key) const
     {
         int counter         = 0;
         iterator cur_it     = top_;
 
+        if constexpr (plain_keys_ && std::is_arithmetic_v<K>)
+        {
+            // a right turn at u adds size(u) - size(u->right()), the second part is taken
+            // off on arrival at u->right(). The turn is applied with a mask: written with ?:
+            // GCC folds it into the equal-key test as jumps. That test is the only branch left
+            int turn = 0; // -1 after a right turn
+            while (cur_it)
+            {
+                counter  -= turn & cur_it->size_;
+                bool right = cur_it->key_ < key;
+                if (!right && !(key < cur_it->key_)) return counter + node_size(cur_it->left());
+                turn      = -static_cast<int>(right);
+                counter  += turn & cur_it->size_;
+                cur_it    = cur_it->child_[right];
+            }
+            return counter;
+        }
+
         while (cur_it)
         {
             const KeyT& k = cur_it->key_;
-            if (cmp_(key,k)) cur_it = cur_it->left_;
+            if (cmp_(key,k)) cur_it = cur_it->left();
             else if (cmp_(k, key))
             {
-                counter += 1 + node_size(cur_it->left_);
-                cur_it   = cur_it->right_;
+                counter += multiplicity(cur_it) + node_size(cur_it->left());
+                cur_it   = cur_it->right();
             }
             else
             {
-                counter += node_size(cur_it->left_);
+                counter += node_size(cur_it->left());
                 break;
             }
 
@@ -237,22 +949,89 @@ namespace Trees {
 //--------------------------- Selectors ---------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------
 
-    template <typename KeyT, typename Comp >
-    int SearchTree<KeyT, Comp>::range_query(const KeyT& a, const KeyT& b) const
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    int SearchTree<KeyT, Comp, Multi, Balance, Arena>::range_query_of(const K& a, const K& b) const
     {
         if (!cmp_(a,b))
         {
            ;return 0;
         }
 
-        iterator fst = lower_bound(a);
-        iterator snd = upper_bound(b);
-        return distance(fst,snd);
+        iterator fst = lower_bound_of(a);
+        iterator snd = upper_bound_of(b);
+        return distance(fst,snd) + buffer_count(a, b);
     }
 
 //-----------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp >
-    int SearchTree<KeyT, Comp>::distance(iterator fst,iterator snd) const
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    int SearchTree<KeyT, Comp, Multi, Balance, Arena>::count_of(const K& key) const
+    {
+        int buffered = buffer_count(key, key);
+
+        iterator node = lower_bound_of(key);
+        if (!node || cmp_(key, node->key_)) return buffered;
+        return multiplicity(node) + buffered;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    int SearchTree<KeyT, Comp, Multi, Balance, Arena>::size() const
+    {
+        if constexpr (!Multi)
+            if (buffer_checked_ < buffer_.size())
+                for (const Buffered_Key& entry : buffer_) buffer_repeat(entry);
+
+        return node_size(top_) + static_cast<int>(buffer_.size() - buffer_repeats_);
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    int SearchTree<KeyT, Comp, Multi, Balance, Arena>::buffer_count(const K& a, const K& b) const
+    {
+        if (buffer_.empty()) return 0;
+
+        auto sorted_end = buffer_.begin() + buffer_sorted_;
+        auto fst = std::lower_bound(buffer_.begin(), sorted_end, a,
+                                    [this](const Buffered_Key& entry, const K& key) { return cmp_(entry.key_, key); });
+        auto snd = std::upper_bound(fst, sorted_end, b,
+                                    [this](const K& key, const Buffered_Key& entry) { return cmp_(key, entry.key_); });
+
+        // set mode: nothing to take off once every key is known to be new
+        int  counter = static_cast<int>(snd - fst);
+        bool repeats = !Multi && (buffer_repeats_ || buffer_checked_ < buffer_.size());
+        if (repeats)
+            for (auto it = fst; it != snd; ++it) counter -= buffer_repeat(*it);
+
+        for (auto it = sorted_end; it != buffer_.end(); ++it) // at most buffer_tail_ keys
+            if (!cmp_(it->key_, a) && !cmp_(b, it->key_)) counter += !(repeats && buffer_repeat(*it));
+
+        return counter;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    bool SearchTree<KeyT, Comp, Multi, Balance, Arena>::buffer_repeat(const Buffered_Key& entry) const
+    {
+        if (!entry.checked_)
+        {
+            entry.checked_  = true;
+            entry.in_tree_  = in_tree(entry.key_);
+            buffer_checked_ += 1;
+            buffer_repeats_ += entry.in_tree_;
+        }
+        return entry.in_tree_;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    bool SearchTree<KeyT, Comp, Multi, Balance, Arena>::in_tree(const K& key) const
+    {
+        iterator node = lower_bound_of(key);
+        return node && !cmp_(key, node->key_);
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    int SearchTree<KeyT, Comp, Multi, Balance, Arena>::distance(iterator fst,iterator snd) const
     {
 
         if (fst == nullptr) return 0;
@@ -263,112 +1042,224 @@ namespace Trees {
         return (count_snd - count_fst);
     }
 //------------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp >
-    typename SearchTree<KeyT, Comp>::iterator
-    SearchTree<KeyT, Comp>::lower_bound(const KeyT& key) const
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::lower_bound_of(const K& key) const
     {
         iterator current_node = top_;
         iterator best_node    = nullptr;
+
+        if constexpr (plain_keys_ && std::is_arithmetic_v<K>)
+        {
+            while (current_node)
+            {
+                bool right   = current_node->key_ < key;
+                best_node    = right ? best_node : current_node;
+                current_node = current_node->child_[right];
+            }
+            return best_node;
+        }
+
         while (current_node)
         {
             if (!cmp_(current_node->key_,key))
             {
                 best_node = current_node;
-                current_node = current_node->left_;
+                current_node = current_node->left();
             }
             else
-                current_node = current_node->right_;
+                current_node = current_node->right();
         }
 
         return best_node;
 
     }
 //------------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp >
-    typename SearchTree<KeyT, Comp>::iterator
-    SearchTree<KeyT, Comp>::upper_bound(const KeyT& key) const
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::upper_bound_of(const K& key) const
     {
         iterator current_node = top_;
         iterator best_node    = nullptr;
+
+        if constexpr (plain_keys_ && std::is_arithmetic_v<K>)
+        {
+            while (current_node)
+            {
+                bool right   = !(key < current_node->key_);
+                best_node    = right ? best_node : current_node;
+                current_node = current_node->child_[right];
+            }
+            return best_node;
+        }
+
         while (current_node)
         {
             if (cmp_(key, current_node->key_))
             {
                 best_node = current_node;
-                current_node = current_node->left_;
+                current_node = current_node->left();
             }
             else
-                current_node = current_node->right_;
+                current_node = current_node->right();
         }
 
         return best_node;
 
     }
-
 //------------------------------------------------------------------------------------------------------
-//----------------------------- Balancing --------------------------------------------------------------
-//-----------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp>
-    inline void SearchTree<KeyT, Comp>::update_metric(iterator root)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::predecessor(iterator node) const
     {
+        if (!node)
+        {
+            if (finger_ && !finger_next_) return finger_; // finger is the maximum
+            iterator cur = top_;
+            while (cur && cur->right()) cur = cur->right();
+            return cur;
+        }
+        if (node == finger_) return finger_prev_;
 
-        int max_height = node_height(root->left_) > node_height(root->right_)  ? node_height(root->left_): node_height(root->right_);
-        root->height_ =  1 + max_height;
-        root->size_   =  1 + node_size(root->left_) + node_size(root->right_);
-
+        if (node->left())
+        {
+            iterator cur = node->left();
+            while (cur->right()) cur = cur->right();
+            return cur;
+        }
+        while (node->parent_ && node->parent_->left() == node)
+            node = node->parent_;
+        return node->parent_;
     }
 
-
-//-------------------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp>
-    int SearchTree<KeyT,Comp>::balance_factor(iterator current_root) const
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Query cache -------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::set_query_cache(size_t slots)
     {
-        int bf = 0;
-        if (current_root->right_)
-            bf -= current_root->right_->height_;
+        static_assert(cacheable_keys_, "the query cache needs std::hash<KeyT> and keys kept in the node");
+
+        if (!slots)
+        {
+            std::vector<Cache_Entry>().swap(cache_);
+            std::vector<Cache_Change>().swap(changes_);
+            version_ = 0;
+            return;
+        }
 
-        if (current_root->left_)
-            bf += current_root->left_->height_;
-        return bf;
+        size_t capacity = cache_window_;
+        while (capacity < slots) capacity <<= 1;
+        cache_.assign(capacity, Cache_Entry{});
+        changes_.clear();
+        changes_.reserve(change_log_);
+        version_     = 0;
+        cache_stats_ = QueryCacheStats{};
     }
-//-------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::note_change(const KeyT& key, int delta)
+    {
+        if (changes_.size() < change_log_) changes_.push_back(Cache_Change{key, delta});
+        else                               changes_[version_ % change_log_] = Cache_Change{key, delta};
+        ++version_;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::clear_query_cache()
+    {
+        for (Cache_Entry& entry : cache_) entry.used_ = false;
+        changes_.clear();
+        version_ = 0;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    bool SearchTree<KeyT, Comp, Multi, Balance, Arena>::catch_up(Cache_Entry& entry) const
+    {
+        if (entry.version_ == version_) return true;
+        if (version_ - entry.version_ > changes_.size()) return false; // older than the log
 
+        int answer = entry.answer_;
+        for (std::uint64_t v = entry.version_; v != version_; ++v)
+        {
+            const Cache_Change& change = changes_[v % change_log_];
+            if (cmp_(change.key_, entry.a_) || cmp_(entry.b_, change.key_)) continue; // outside [a, b]
+            answer += change.delta_;
+        }
 
-    template <typename KeyT,typename Comp>
-    void SearchTree<KeyT, Comp>::rebalance(iterator root)
+        entry.answer_  = answer;
+        entry.version_ = version_;
+        ++cache_stats_.adjusted;
+        return true;
+    }
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    int SearchTree<KeyT, Comp, Multi, Balance, Arena>::cached_range_query(const KeyT& a, const KeyT& b) const
     {
-        iterator current_root = root->parent_;
-        while (current_root)
-        {
+        if (!cmp_(a, b)) return 0;
 
-            update_metric(current_root);
-            int bf  = balance_factor(current_root);
+        std::uint64_t h = std::hash<KeyT>{}(a) * 0x9E3779B97F4A7C15ull ^ std::hash<KeyT>{}(b);
+        h ^= h >> 31;
+        h *= 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 29;
 
-            if (bf <-1 ||bf > 1)
+        const size_t mask   = cache_.size() - 1;
+        Cache_Entry* victim = nullptr; // free slot, else the one written longest ago
+        for (size_t i = 0; i < cache_window_; ++i)
+        {
+            Cache_Entry& entry = cache_[(static_cast<size_t>(h) + i) & mask];
+            if (entry.used_ && !cmp_(entry.a_, a) && !cmp_(a, entry.a_) && !cmp_(entry.b_, b) && !cmp_(b, entry.b_))
             {
-                current_root = balance(current_root,bf);
+                if (catch_up(entry))
+                {
+                    ++cache_stats_.hits;
+                    return entry.answer_;
+                }
+                victim = &entry;
+                break;
             }
-            current_root = current_root->parent_;
+            if (!victim || (victim->used_ && (!entry.used_ || entry.version_ < victim->version_)))
+                victim = &entry;
         }
+
+        ++cache_stats_.misses;
+        int answer       = range_query_of(a, b);
+        victim->a_       = a;
+        victim->b_       = b;
+        victim->answer_  = answer;
+        victim->version_ = version_;
+        victim->used_    = true;
+        return answer;
+    }
+
+//------------------------------------------------------------------------------------------------------
+//----------------------------- Balancing --------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    inline void SearchTree<KeyT, Comp, Multi, Balance, Arena>::update_size(iterator root)
+    {
+        root->size_   =  multiplicity(root) + node_size(root->left()) + node_size(root->right());
     }
 //-------------------------------------------------------------------------------------------------------------
 
-    template <typename KeyT, typename Comp >
-    typename SearchTree<KeyT, Comp>::iterator
-    SearchTree< KeyT, Comp>::rotate_right(iterator root)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::rotate_right(iterator root)
     {
 
 
-        iterator new_root    = root->left_;
+        iterator new_root    = root->left();
 
         new_root ->parent_   = root->parent_;
 
         if (root->parent_)
         {
-            if (root->parent_->left_ == root)
-                root->parent_->left_ = new_root;
+            if (root->parent_->left() == root)
+                root->parent_->left() = new_root;
             else
-                root->parent_->right_ = new_root;
+                root->parent_->right() = new_root;
 
         }
         else
@@ -376,37 +1267,38 @@ namespace Trees {
             top_ = new_root;
 
         }
-        iterator temp_right  = new_root->right_;
+        iterator temp_right  = new_root->right();
 
-        new_root->right_     = root;
-        root->left_          = temp_right;
+        new_root->right()     = root;
+        root->left()          = temp_right;
 
         root->parent_            = new_root;
 
         if (temp_right) temp_right->parent_ = root;
-        update_metric(root);
-        update_metric(new_root);
+        TREES_DETAIL_COUNT(rotations);
+        update_size(root);
+        update_size(new_root);
 
         return new_root;
     }
 //-------------------------------------------------------------------------------------------------------------
 
 
-    template <typename KeyT, typename Comp >
-    typename SearchTree<KeyT, Comp>::iterator
-    SearchTree< KeyT, Comp>::rotate_left(iterator root)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::rotate_left(iterator root)
     {
 
-        iterator new_root    = root->right_;
+        iterator new_root    = root->right();
 
         new_root ->parent_   = root->parent_;
 
         if (root->parent_)
         {
-            if (root->parent_->left_ == root)
-                root->parent_->left_ = new_root;
+            if (root->parent_->left() == root)
+                root->parent_->left() = new_root;
             else
-                root->parent_->right_ = new_root;
+                root->parent_->right() = new_root;
 
         }
         else
@@ -414,92 +1306,497 @@ namespace Trees {
             top_ = new_root;
 
         }
-        iterator temp_left  = new_root->left_;
+        iterator temp_left  = new_root->left();
 
-        new_root->left_    = root;
-        root->right_       = temp_left;
+        new_root->left()    = root;
+        root->right()       = temp_left;
 
         root->parent_      = new_root;
 
         if (temp_left) temp_left->parent_ = root;
-        update_metric(root);
-        update_metric(new_root);
+        TREES_DETAIL_COUNT(rotations);
+        update_size(root);
+        update_size(new_root);
 
         return new_root;
     }
 //-------------------------------------------------------------------------------------------------------------
 
 
-    template <typename KeyT, typename Comp >
-    typename SearchTree<KeyT, Comp>::iterator
-    SearchTree< KeyT, Comp>::balance(iterator root, int bf)
-    {
-        if (bf > 1)
-        {
-            if (root->left_ && balance_factor(root->left_) < 0)
-                root->left_ = rotate_left(root->left_);
-            root = rotate_right(root);
-        }
-        else if (bf < -1)
-        {
-            if (root->right_ && balance_factor(root ->right_) > 0)
-                root->right_ = rotate_right(root->right_);
-            root = rotate_left(root);
-        }
-
-        return root;
-    }
 //-----------------------------------------------------------------------------------------------------
 //---------------------- Insertion helpers ------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------
-    template <typename KeyT, typename Comp >
-    typename SearchTree<KeyT, Comp>::iterator
-    SearchTree< KeyT, Comp>::bst_insert(const KeyT& key)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K, typename... Args>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::bst_insert(const K& key, int n, bool& inserted, Args&&... args)
     {
-        if (!top_) // top_ == nullptr
+        inserted = true;
+
+        if (finger_) // sorted runs land in one of the gaps next to the last inserted node
         {
-            top_ = get_node(key);
-            return top_;
+            iterator node = nullptr;
+            if (cmp_(finger_->key_, key))
+            {
+                if (!finger_next_ || cmp_(key, finger_next_->key_))
+                    node = link_into_gap(finger_, finger_next_, n, std::forward<Args>(args)...);
+            }
+            else if (cmp_(key, finger_->key_))
+            {
+                if (!finger_prev_ || cmp_(finger_prev_->key_, key))
+                    node = link_into_gap(finger_prev_, finger_, n, std::forward<Args>(args)...);
+            }
+            else // duplicate
+            {
+                inserted = false;
+                if constexpr (Multi)
+                {
+                    finger_->count_ += n;
+                    add_to_path(finger_, n);
+                }
+                return finger_;
+            }
+
+            if (node)
+            {
+                add_to_path(node->parent_, n);
+                return node;
+            }
         }
 
-        iterator parent = nullptr;
-        iterator child  = top_;
+        iterator prev  = nullptr; // last node we went right from
+        iterator next  = nullptr; // last node we went left from
+        iterator child = top_;
 
         while (child)
         {
-            parent = child;
+            child->size_ += n; // counted on the way down, rolled back on a duplicate
+            TREES_DETAIL_COUNT(size_updates);
 
             if (cmp_(child->key_,key))
-                child = child->right_; // go right
+            {
+                prev  = child;
+                child = child->right(); // go right
+            }
             else if (cmp_(key,child->key_))
-                child = child->left_; // go left
-            else
-                return child; // not duplicate
+            {
+                next  = child;
+                child = child->left(); // go left
+            }
+            else // duplicate
+            {
+                inserted = false;
+                if constexpr (Multi)
+                    child->count_ += n;
+                else
+                    add_to_path(child, -n);
+                return child;
+            }
         }
 
-        child          = get_node(key);
+        try {
+            return link_into_gap(prev, next, n, std::forward<Args>(args)...);
+        }
+        catch (...) { // the key did not construct: undo the sizes counted on the way down
+            add_to_path(prev && !prev->right() ? prev : next, -n);
+            throw;
+        }
+    }
 
-        child->parent_ = parent;
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename... Args>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::link_into_gap(iterator prev, iterator next, int n, Args&&... args)
+    {
+        // prev and next are neighbours in order, so one of the two child slots is free:
+        // either next is the leftmost node of prev's right subtree or vice versa
+        iterator child = get_node(std::forward<Args>(args)...);
+        if constexpr (Multi) child->count_ = n;
+        child->size_   = n;
 
-        if (cmp_(parent->key_,key))
-            parent->right_ = child;
+        if (prev && !prev->right())
+        {
+            prev->right()   = child;
+            child->parent_ = prev;
+        }
+        else if (next)
+        {
+            next->left()    = child;
+            child->parent_ = next;
+        }
         else
-            parent->left_  = child;
+        {
+            top_ = child;
+        }
 
+        finger_      = child;
+        finger_prev_ = prev;
+        finger_next_ = next;
         return child;
     }
 
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::add_to_path(iterator node, int delta)
+    {
+        for (; node; node = node->parent_)
+        {
+            node->size_ += delta;
+            TREES_DETAIL_COUNT(size_updates);
+        }
+    }
+
+//-----------------------------------------------------------------------------------------------------
+//---------------------- Erase helpers ----------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::remove_node(iterator node)
+    {
+        iterator victim = node;
+        if (node->left() && node->right()) // take successor's key, unlink successor instead
+        {
+            victim = node->right();
+            while (victim->left()) victim = victim->left();
+
+            node->key_   = std::move(victim->key_);
+            if constexpr (Multi) node->count_ = victim->count_;
+        }
+
+        iterator child  = victim->left() ? victim->left() : victim->right();
+        iterator parent = victim->parent_;
+
+        if (child) child->parent_ = parent;
+
+        if (!parent)                     top_ = child;
+        else if (parent->left() == victim) parent->left()  = child;
+        else                             parent->right() = child;
+
+        for (iterator cur = parent; cur; cur = cur->parent_)
+        {
+            update_size(cur);
+            TREES_DETAIL_COUNT(size_updates);
+        }
+        balance_.after_erase(*this, parent, child);
+        release_node(victim);
+    }
+
 //-------------------------------------------------------------------------------------------------------
 //---------------------------- modifiers ----------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------
 
-    template <typename KeyT, typename Comp >
-    void SearchTree< KeyT, Comp>::insert(const KeyT& key)
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::insert(const KeyT& key, int n)
+    {
+        if (n <= 0) return;
+        if constexpr (!Multi) n = 1;
+
+        if (buffer_limit_ && n == 1)
+            buffer_insert(key);
+        else if (iterator node = tree_insert(key, n, key); node && !cache_.empty())
+            note_change(node->key_, n);
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename... Args>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::emplace(Args&&... args)
+    {
+        if constexpr (sizeof...(Args) == 1 && (lookup_key_v<Args> && ...))
+            insert_key(std::forward<Args>(args)...);
+        else
+            insert_key(KeyT(std::forward<Args>(args)...)); // nothing to compare with before
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::insert_key(K&& key)
+    {
+        if (buffer_limit_)
+            buffer_insert(std::forward<K>(key));
+        else if (iterator node = tree_insert(key, 1, std::forward<K>(key)); node && !cache_.empty())
+            note_change(node->key_, 1); // key is forwarded only into a new node, node->key_ is the one
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K, typename... Args>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::tree_insert(const K& key, int n, Args&&... args)
+    {
+        bool inserted     = false;
+        iterator new_node = bst_insert(key, n, inserted, std::forward<Args>(args)...);
+        if (inserted) balance_.after_insert(*this, new_node);
+        return (inserted || Multi) ? new_node : nullptr;
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    typename SearchTree<KeyT, Comp, Multi, Balance, Arena>::iterator
+    SearchTree<KeyT, Comp, Multi, Balance, Arena>::insert(iterator hint, const KeyT& key)
+    {
+        flush(); // a buffered copy of key must not end up next to a tree node
+        iterator prev = predecessor(hint);
+        bool inserted = false;
+        iterator node = nullptr;
+
+        if ((!prev || cmp_(prev->key_, key)) && (!hint || cmp_(key, hint->key_)))
+        {
+            inserted = true;
+            node     = link_into_gap(prev, hint, 1, key);
+            add_to_path(node->parent_, 1);
+        }
+        else
+        {
+            node = bst_insert(key, 1, inserted, key); // wrong hint
+        }
+
+        if (inserted) balance_.after_insert(*this, node);
+        if ((inserted || Multi) && !cache_.empty()) note_change(node->key_, 1);
+        return node;
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    bool SearchTree<KeyT, Comp, Multi, Balance, Arena>::erase_one(const KeyT& key)
+    {
+        flush();
+
+        iterator node = lower_bound(key);
+        if (!node || cmp_(key, node->key_)) return false;
+
+        if (multiplicity(node) > 1)
+        {
+            if constexpr (Multi) node->count_--;
+            add_to_path(node, -1);
+        }
+        else
+        {
+            reset_finger();
+            remove_node(node);
+        }
+        if (!cache_.empty()) note_change(key, -1);
+        return true;
+    }
+//--------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------------
+//---------------------------- write buffer --------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    template <typename K>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::buffer_insert(K&& key)
+    {
+        bool checked = false;
+        if constexpr (!Multi)
+        {
+            auto sorted_end = buffer_.begin() + buffer_sorted_;
+            auto found = std::lower_bound(buffer_.begin(), sorted_end, key,
+                                          [this](const Buffered_Key& entry, const K& k) { return cmp_(entry.key_, k); });
+            if (found != sorted_end && !cmp_(key, found->key_)) return;
+            for (auto it = sorted_end; it != buffer_.end(); ++it)
+                if (!cmp_(it->key_, key) && !cmp_(key, it->key_)) return;
+
+            // the change log has to be exact, so with the cache on the lookup is not put off
+            if (!cache_.empty())
+            {
+                if (in_tree(key)) return;
+                checked = true;
+                buffer_checked_ += 1;
+            }
+        }
+
+        buffer_.push_back(Buffered_Key{keys_.make(std::forward<K>(key)), checked, false});
+        if (!cache_.empty()) note_change(buffer_.back().key_, 1);
+        if (buffer_.size() >= buffer_limit_)                   flush();
+        else if (buffer_.size() - buffer_sorted_ >= buffer_tail_) merge_buffer_tail();
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::merge_buffer_tail()
     {
-        iterator new_node = bst_insert(key);
-        rebalance(new_node);
+        // the tail (at most buffer_tail_ keys) goes aside and the merge runs from the back,
+        // so the buffer is merged in place without a temporary allocation
+        auto by_key = [this](const Buffered_Key& x, const Buffered_Key& y) { return cmp_(x.key_, y.key_); };
+        std::sort(buffer_.begin() + buffer_sorted_, buffer_.end(), by_key);
+        buffer_scratch_.assign(std::make_move_iterator(buffer_.begin() + buffer_sorted_),
+                               std::make_move_iterator(buffer_.end()));
+
+        size_t i = buffer_sorted_, j = buffer_scratch_.size(), out = buffer_.size();
+        while (j)
+        {
+            if (i && by_key(buffer_scratch_[j - 1], buffer_[i - 1])) buffer_[--out] = std::move(buffer_[--i]);
+            else                                                      buffer_[--out] = std::move(buffer_scratch_[--j]);
+        }
+        buffer_scratch_.clear();
+        buffer_sorted_ = buffer_.size();
     }
 //--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::flush()
+    {
+        if (buffer_.empty()) return;
+
+        merge_buffer_tail();
+
+        std::vector<Buffered_Key> batch;
+        batch.swap(buffer_);
+        buffer_sorted_  = 0;
+        buffer_checked_ = 0;
+        buffer_repeats_ = 0;
+
+        // sorted order: neighbouring keys share the descent path (and the finger gap);
+        // unchecked repeats of tree keys are dropped by tree_insert
+        for (size_t i = 0; i < batch.size();)
+        {
+            size_t j = i + 1;
+            while (j < batch.size() && !cmp_(batch[i].key_, batch[j].key_)) ++j; // equal keys (multi)
+            if (!batch[i].in_tree_)
+                tree_insert(batch[i].key_, static_cast<int>(j - i), Stored_Key{batch[i].key_});
+            i = j;
+        }
 
+        batch.clear();
+        buffer_.swap(batch); // keep the capacity
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::set_write_buffer(size_t limit)
+    {
+        flush();
+        buffer_limit_ = limit;
+        buffer_.reserve(limit);
+        buffer_scratch_.reserve(limit ? buffer_tail_ : 0);
+    }
+//--------------------------------------------------------------------------------------------------------
+//---------------------------- snapshots -----------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::fill_header(Snapshot_Header& header, std::uint64_t nodes)
+    {
+        header = Snapshot_Header{};
+        std::memcpy(header.magic_, snapshot_magic_, sizeof(header.magic_));
+        std::strncpy(header.balance_, Balance::name, sizeof(header.balance_));
+        header.key_size_ = sizeof(KeyT);
+        header.multi_    = Multi;
+        header.nodes_    = nodes;
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::save(const std::string& path)
+    {
+        static_assert(std::is_trivially_copyable_v<KeyT> && !KeyTraits<KeyT>::owns_bytes,
+                      "snapshots need a trivially copyable key kept in the node");
+        flush();
+
+        std::vector<iterator> order; // BFS order, a node's index is its position here
+        if (top_) order.push_back(top_);
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            if (order[i]->left())  order.push_back(order[i]->left());
+            if (order[i]->right()) order.push_back(order[i]->right());
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("failed to open snapshot " + path);
+
+        Snapshot_Header header;
+        fill_header(header, order.size());
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::vector<std::int64_t> parent(order.size(), -1);
+        std::int64_t next = 1; // index of the next child in BFS order
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            iterator node = order[i];
+
+            Snapshot_Node record{}; // zeroes the padding
+            record.key_    = node->key_;
+            record.left_   = node->left()  ? next++ : -1;
+            record.right_  = node->right() ? next++ : -1;
+            record.parent_ = parent[i];
+            record.height_ = node->height_;
+            record.size_   = node->size_;
+            record.count_  = multiplicity(node);
+
+            if (record.left_  >= 0) parent[record.left_]  = static_cast<std::int64_t>(i);
+            if (record.right_ >= 0) parent[record.right_] = static_cast<std::int64_t>(i);
+
+            out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
+
+        if (!out) throw std::runtime_error("failed to write snapshot " + path);
+    }
+//--------------------------------------------------------------------------------------------------------
+    template <typename KeyT, typename Comp, bool Multi, typename Balance, typename Arena>
+    void SearchTree<KeyT, Comp, Multi, Balance, Arena>::load(const std::string& path)
+    {
+        static_assert(std::is_trivially_copyable_v<KeyT> && !KeyTraits<KeyT>::owns_bytes,
+                      "snapshots need a trivially copyable key kept in the node");
+
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw std::runtime_error("failed to open snapshot " + path);
+
+        Snapshot_Header header;
+        Snapshot_Header expected;
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        fill_header(expected, header.nodes_);
+        if (!in || std::memcmp(&header, &expected, sizeof(header)) != 0)
+            throw std::runtime_error("incompatible snapshot " + path);
+
+        // the node count comes from the file: check it against the file length before
+        // it sizes an allocation
+        std::streamoff body = in.tellg();
+        in.seekg(0, std::ios::end);
+        std::streamoff length = in.tellg();
+        in.seekg(body);
+        if (!in || header.nodes_ > static_cast<std::uint64_t>(length - body) / sizeof(Snapshot_Node))
+            throw std::runtime_error("truncated snapshot " + path);
+
+        SearchTree tree;
+        tree.cmp_   = cmp_;
+        tree.arena_ = arena_;
+
+        // one block for the whole tree, indices become pointers in the same pass; what
+        // reserve() made room for stays reserved
+        const std::int64_t n = static_cast<std::int64_t>(header.nodes_);
+        size_t capacity      = std::max(static_cast<size_t>(n), node_capacity());
+        if (capacity) tree.add_block(capacity);
+
+        if (n)
+        {
+            Block_Memory& block = tree.mem_blocks_.back();
+            auto link = [&](std::int64_t index) -> iterator
+            {
+                if (index < -1 || index >= n) throw std::runtime_error("corrupt snapshot " + path);
+                return index < 0 ? nullptr : block.begin_ + index;
+            };
+
+            for (std::int64_t i = 0; i < n; ++i)
+            {
+                Snapshot_Node record;
+                in.read(reinterpret_cast<char*>(&record), sizeof(record));
+                if (!in) throw std::runtime_error("truncated snapshot " + path);
+
+                iterator node = ::new (block.cur_) Node{record.key_};
+                block.cur_++;
+                node->left()   = link(record.left_);
+                node->right()  = link(record.right_);
+                node->parent_ = link(record.parent_);
+                node->height_ = record.height_;
+                node->size_   = record.size_;
+                if constexpr (Multi) node->count_ = record.count_;
+            }
+            tree.top_ = block.begin_;
+        }
+
+        std::swap(top_,       tree.top_);
+        std::swap(mem_blocks_,tree.mem_blocks_);
+        std::swap(fill_block_,tree.fill_block_);
+        reset_finger();
+        buffer_.clear();
+        buffer_sorted_  = 0;
+        buffer_checked_ = 0;
+        buffer_repeats_ = 0;
+        clear_query_cache();
+    }
 
 }
+
+#undef TREES_DETAIL_COUNT
+#undef TREES_DETAIL_COUNT_OF
@@ -1,12 +1,15 @@
 #include "runner_set.hpp"
 #include <iostream>
 #include <exception>
+#include <cstring>
 
-int main()
+int main(int argc, char** argv)
 {
     try
     {
-    return launcher_set(std::cin, std::cout,true);
+    bool multi = (argc > 1 && std::strcmp(argv[1], "--multi") == 0); // keep duplicates
+    return multi ? launcher_multiset(std::cin, std::cout,true)
+                 : launcher_set(std::cin, std::cout,true);
     }
     catch (const std::exception& e)
     {
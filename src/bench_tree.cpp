@@ -1,11 +1,31 @@
 #include "runner.hpp"
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
 #include <exception>
+#include <new>
 
-int main()
+// every heap allocation of the benchmark is counted, the runner reports the run's share
+static std::atomic<long long> heap_allocations{0};
+
+void* operator new(std::size_t size)
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept              { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+static long long allocation_count() { return heap_allocations.load(std::memory_order_relaxed); }
+
+int main(int argc, char** argv)
 {
-    try {
-    return launcher(std::cin, std::cout,true);
+    try
+    {
+    LaunchOptions options = parse_launch_options(argc, argv);
+    options.allocations   = allocation_count;
+    return launcher(std::cin, std::cout,true, options);
     }
     catch (const std::exception& e)
     {
@@ -1,12 +1,12 @@
 #include "runner.hpp"
 #include <iostream>
+#include <exception>
 
-
-int main()
+int main(int argc, char** argv)
 {
     try
     {
-    return launcher(std::cin, std::cout,false);
+    return launcher(std::cin, std::cout,false, parse_launch_options(argc, argv));
     }
     catch (const std::exception& e)
     {
@@ -1,17 +1,104 @@
 #include "runner.hpp"
 #include <Trees/Tree.hpp>
 #include <chrono>
+#include <iomanip>
 #include <iostream>
+#include <memory_resource>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
 
-int launcher(std::istream& in, std::ostream& out, bool benchmark)
+namespace {
+
+// how commands reach the tree: Keys::key_type/compare make the tree, insert/query take the ints read
+struct IntKeys
+{
+    using key_type = int;
+    using compare  = std::less<>;
+
+    template <typename Tree> static void insert(Tree& tree, int x)              { tree.insert(x); }
+    template <typename Tree> static int  query(const Tree& tree, int a, int b)  { return tree.range_query(a, b); }
+};
+
+// ints written as fixed-width text in the same order, longer than the SSO buffer
+struct TextKeys
+{
+    using key_type = std::string;
+    using compare  = std::less<>;
+
+    struct Text
+    {
+        char buf_[20] = {'i','t','e','m','/','k','e','y','/'};
+
+        std::string_view operator()(int x)
+        {
+            unsigned v = static_cast<unsigned>(x) ^ 0x80000000u; // order of the signed value
+            for (int i = 18; i >= 9; --i, v /= 10) buf_[i] = static_cast<char>('0' + v % 10);
+            return std::string_view(buf_, 19);
+        }
+    };
+};
+
+struct StringKeys : TextKeys // no std::string unless a new node needs one
+{
+    template <typename Tree> static void insert(Tree& tree, int x)
+    {
+        Text key;
+        tree.emplace(key(x));
+    }
+    template <typename Tree> static int query(const Tree& tree, int a, int b)
+    {
+        Text fst, snd;
+        return tree.range_query(fst(a), snd(b));
+    }
+};
+
+struct StringCopyKeys : TextKeys // the const KeyT& interface: a std::string per key, copied in
+{
+    template <typename Tree> static void insert(Tree& tree, int x)
+    {
+        Text key;
+        const std::string str(key(x));
+        tree.insert(str);
+    }
+    template <typename Tree> static int query(const Tree& tree, int a, int b)
+    {
+        Text fst, snd;
+        return tree.range_query(std::string(fst(a)), std::string(snd(b)));
+    }
+};
+
+struct PrefixKeys : TextKeys // inline prefixes, key bytes in the tree's arena
+{
+    using key_type = Trees::PrefixString;
+    using compare  = std::less<Trees::PrefixString>;
+
+    template <typename Tree> static void insert(Tree& tree, int x)
+    {
+        Text key;
+        tree.insert(Trees::PrefixString(key(x)));
+    }
+    template <typename Tree> static int query(const Tree& tree, int a, int b)
+    {
+        Text fst, snd;
+        return tree.range_query(fst(a), snd(b)); // each converted once
+    }
+};
+
+template <typename Keys, typename Tree>
+int run_commands(Tree& tree, std::istream& in, std::ostream& out, bool benchmark, const LaunchOptions& options)
 {
     using clock = std::chrono::steady_clock;
     using ns    = std::chrono::nanoseconds;
 
-    Trees::SearchTree<int> tree;
     char op;
     ns acc{0};
+    ns query_acc{0};
+    long long queries = 0;
+    long long checksum = 0; // keeps the timed queries from being optimised away
+    long long (*allocations)() = options.allocations;
+    long long allocs = allocations ? allocations() : 0;
     try {
         while (in >> op)
         {
@@ -26,13 +113,13 @@ int launcher(std::istream& in, std::ostream& out, bool benchmark)
                 if (benchmark)
                 {
                     auto t0 = clock::now();
-                    tree.insert(x);
+                    Keys::insert(tree, x);
                     auto t1 = clock::now();
                     acc += (t1 - t0);
                 }
                 else
                 {
-                    tree.insert(x);
+                    Keys::insert(tree, x);
                 }
             }
             else if (op == 'q')
@@ -49,15 +136,18 @@ int launcher(std::istream& in, std::ostream& out, bool benchmark)
 
                     int ans = 0;
                     if (b > a)
-                        ans = tree.range_query(a, b);
+                        ans = Keys::query(tree, a, b);
                     auto t1 = clock::now();
-                    acc += (t1 - t0);
+                    acc       += (t1 - t0);
+                    query_acc += (t1 - t0);
+                    checksum  += ans;
+                    ++queries;
                 }
                 else
                 {
                     int ans = 0;
                     if (b > a)
-                        ans = tree.range_query(a, b);
+                        ans = Keys::query(tree, a, b);
 
                     out << ans << ' ';
                 }
@@ -73,6 +163,27 @@ int launcher(std::istream& in, std::ostream& out, bool benchmark)
     {
         auto nas = std::chrono::duration_cast<std::chrono::milliseconds>(acc).count();
         out << nas << " ms\n";
+        out << "checksum: " << checksum << '\n';
+        if (allocations)
+            out << "allocations: " << allocations() - allocs << '\n';
+        if (options.query_cache)
+        {
+            const Trees::QueryCacheStats& c = tree.query_cache_stats();
+            std::ios::fmtflags flags = out.flags();
+            std::streamsize precision = out.precision();
+            out << std::fixed << std::setprecision(1);
+            out << "query cache: " << c.hits << " hits (" << c.adjusted << " adjusted), " << c.misses
+                << " misses, hit rate " << 100.0 * c.hit_rate() << "%, "
+                << (queries ? double(query_acc.count()) / double(queries) : 0.0) << " ns per query\n";
+            out.flags(flags);
+            out.precision(precision);
+        }
+#ifdef TREES_INSTRUMENT
+        const Trees::OpCounters& c = tree.counters();
+        out << "metric updates: " << c.metric_updates
+            << ", size updates: "  << c.size_updates
+            << ", rotations: "     << c.rotations << '\n';
+#endif
     }
     else
     {
@@ -81,3 +192,187 @@ int launcher(std::istream& in, std::ostream& out, bool benchmark)
 
     return 0;
 }
+
+template <typename Tree>
+void print_stats(const Tree& tree, std::ostream& out)
+{
+    Trees::MemoryStats mem  = tree.memory_stats();
+    Trees::ShapeStats shape = tree.shape_stats();
+
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(2);
+
+    out << "memory: " << mem.nodes << " nodes of " << mem.node_size << " B in " << mem.blocks << " blocks, "
+        << mem.bytes_used << " of " << mem.bytes_reserved << " B used (" << 100.0 * mem.utilization() << "%), "
+        << mem.key_bytes << " B keys, " << mem.buffer_bytes << " B buffer, "
+        << mem.bytes_per_node() << " B/node\n";
+    out << "shape: height " << shape.height << ", average path " << shape.average_path
+        << ", cache lines per path " << shape.average_path_lines << " (max " << shape.max_path_lines << ")\n";
+    out << "depths:";
+    for (size_t count : shape.depth_histogram) out << ' ' << count;
+    out << '\n';
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+// --arena= is a run-time choice: every tree here uses PmrArena, the flag only picks the
+// resource below it, so arenas do not multiply the Keys x Multi x Balance instantiations
+class HugePageResource : public std::pmr::memory_resource
+{
+    private:
+        Trees::HugePageArena arena_;
+
+        static size_t rounded(size_t bytes) // what HugePageArena maps for a request of bytes
+        {
+            constexpr size_t page = Trees::HugePageArena::huge_page_size;
+            return (bytes + page - 1) / page * page;
+        }
+
+        void* do_allocate(size_t bytes, size_t alignment) override { return arena_.allocate(bytes, alignment); }
+        void  do_deallocate(void* p, size_t bytes, size_t alignment) override { arena_.deallocate(p, rounded(bytes), alignment); }
+        bool  do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+template <typename Keys, bool Multi, typename Balance>
+int run_tree(std::istream& in, std::ostream& out, bool benchmark, const LaunchOptions& options,
+             std::pmr::memory_resource* upstream)
+{
+    using Arena = Trees::PmrArena;
+
+    using clock = std::chrono::steady_clock;
+    using Key   = typename Keys::key_type;
+    using Tree  = Trees::SearchTree<Key, typename Keys::compare, Multi, Balance, Arena>;
+    constexpr bool snapshots = std::is_trivially_copyable_v<Key> && !Trees::KeyTraits<Key>::owns_bytes;
+    constexpr bool cacheable = std::is_same_v<Keys, IntKeys> || std::is_same_v<Keys, StringCopyKeys>;
+
+    if constexpr (!snapshots)
+    {
+        if (!options.load_snapshot.empty() || !options.save_snapshot.empty())
+            throw std::invalid_argument("snapshots need --keys=int");
+    }
+    if constexpr (!cacheable) // the cache is keyed by KeyT bounds kept outside the tree
+    {
+        if (options.query_cache)
+            throw std::invalid_argument("--query-cache needs --keys=int or --keys=string-copy");
+    }
+
+    Arena arena{upstream};
+    arena.set_growth(512, 2.0, options.max_block);
+    Tree tree;
+    tree.arena() = arena;
+    tree.reserve(options.reserve);
+    tree.set_write_buffer(options.buffer);
+    if constexpr (cacheable)
+        tree.set_query_cache(options.query_cache);
+
+    if constexpr (snapshots)
+    {
+        if (!options.load_snapshot.empty())
+        {
+            auto t0 = clock::now();
+            tree.load(options.load_snapshot);
+            auto t1 = clock::now();
+            if (benchmark)
+                out << "snapshot load: " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms\n";
+        }
+    }
+
+    int rc = run_commands<Keys>(tree, in, out, benchmark, options);
+    if (rc == 0 && options.stats)
+        print_stats(tree, out);
+
+    if constexpr (snapshots)
+    {
+        if (rc == 0 && !options.save_snapshot.empty())
+            tree.save(options.save_snapshot);
+    }
+    return rc;
+}
+
+template <typename Keys, bool Multi, typename Balance>
+int run_arena(std::istream& in, std::ostream& out, bool benchmark, const LaunchOptions& options)
+{
+    const std::string& arena = options.arena;
+    if (arena == "heap") return run_tree<Keys, Multi, Balance>(in, out, benchmark, options, std::pmr::new_delete_resource());
+    if (arena == "huge")
+    {
+        HugePageResource upstream;
+        return run_tree<Keys, Multi, Balance>(in, out, benchmark, options, &upstream);
+    }
+    if (arena == "pmr")
+    {
+        std::pmr::monotonic_buffer_resource upstream; // nodes are never freed in a run
+        return run_tree<Keys, Multi, Balance>(in, out, benchmark, options, &upstream);
+    }
+    throw std::invalid_argument("unknown arena: " + arena);
+}
+
+template <typename Keys, bool Multi>
+int run_balanced(std::istream& in, std::ostream& out, bool benchmark, const LaunchOptions& options)
+{
+    const std::string& balance = options.balance;
+    if (balance == "avl")   return run_arena<Keys, Multi, Trees::AvlBalance>(in, out, benchmark, options);
+    if (balance == "wavl")  return run_arena<Keys, Multi, Trees::WavlBalance>(in, out, benchmark, options);
+    if (balance == "treap") return run_arena<Keys, Multi, Trees::TreapBalance>(in, out, benchmark, options);
+    throw std::invalid_argument("unknown balancing policy: " + balance);
+}
+
+template <bool Multi>
+int run_keys(std::istream& in, std::ostream& out, bool benchmark, const LaunchOptions& options)
+{
+    const std::string& keys = options.keys;
+    if (keys == "int")         return run_balanced<IntKeys, Multi>(in, out, benchmark, options);
+    if (keys == "string")      return run_balanced<StringKeys, Multi>(in, out, benchmark, options);
+    if (keys == "string-copy") return run_balanced<StringCopyKeys, Multi>(in, out, benchmark, options);
+    if (keys == "prefix")      return run_balanced<PrefixKeys, Multi>(in, out, benchmark, options);
+    throw std::invalid_argument("unknown key type: " + keys);
+}
+
+} // namespace
+
+LaunchOptions parse_launch_options(int argc, char** argv)
+{
+    LaunchOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--multi")
+            options.multi = true;
+        else if (arg.rfind("--balance=", 0) == 0)
+            options.balance = arg.substr(10);
+        else if (arg.rfind("--buffer=", 0) == 0)
+            options.buffer  = std::stoul(arg.substr(9));
+        else if (arg.rfind("--arena=", 0) == 0)
+            options.arena   = arg.substr(8);
+        else if (arg.rfind("--reserve=", 0) == 0)
+            options.reserve = std::stoul(arg.substr(10));
+        else if (arg.rfind("--max-block=", 0) == 0)
+            options.max_block = std::stoul(arg.substr(12));
+        else if (arg.rfind("--load-snapshot=", 0) == 0)
+            options.load_snapshot = arg.substr(16);
+        else if (arg.rfind("--save-snapshot=", 0) == 0)
+            options.save_snapshot = arg.substr(16);
+        else if (arg == "--stats")
+            options.stats = true;
+        else if (arg.rfind("--keys=", 0) == 0)
+            options.keys = arg.substr(7);
+        else if (arg.rfind("--query-cache=", 0) == 0)
+            options.query_cache = std::stoul(arg.substr(14));
+        else
+            throw std::invalid_argument("unknown option: " + arg);
+    }
+    return options;
+}
+
+int launcher(std::istream& in, std::ostream& out, bool benchmark)
+{
+    return launcher(in, out, benchmark, LaunchOptions{});
+}
+
+int launcher(std::istream& in, std::ostream& out, bool benchmark, const LaunchOptions& options)
+{
+    return options.multi ? run_keys<true>(in, out, benchmark, options)
+                         : run_keys<false>(in, out, benchmark, options);
+}
@@ -2,6 +2,31 @@
 
 #include <istream>
 #include <ostream>
+#include <cstddef>
+#include <string>
 
-int launcher(std::istream& in, std:: ostream& out, bool benchmark = false);
+struct LaunchOptions
+{
+    bool        multi   = false; // --multi: duplicates are counted
+    std::string balance = "avl"; // --balance=avl|wavl|treap
+    size_t      buffer  = 0;     // --buffer=N: write buffer of N keys, 0 - off
+    std::string arena   = "heap"; // --arena=heap|huge|pmr: where node blocks come from
+    size_t      reserve = 0;     // --reserve=N: pre-size the arena for N nodes
+    size_t      max_block = 0;   // --max-block=N: cap on nodes per block, 0 - unlimited
+    std::string load_snapshot;   // --load-snapshot=PATH: start from a saved tree
+    std::string save_snapshot;   // --save-snapshot=PATH: save the tree after the run
+    bool        stats   = false; // --stats: print memory_stats/shape_stats after the run
+    std::string keys    = "int"; // --keys=int|string|string-copy|prefix: string keys are the
+                                 // ints as text; "string" looks them up by string_view and
+                                 // emplaces, "string-copy" builds a std::string for every key,
+                                 // "prefix" uses Trees::PrefixString
+    size_t      query_cache = 0; // --query-cache=N: cache N range_query answers, 0 - off
+                                 // (int and string-copy keys)
+
+    long long (*allocations)() = nullptr; // heap allocations so far, reported in bench mode
+};
 
+LaunchOptions parse_launch_options(int argc, char** argv); // throws on an unknown flag
+
+int launcher(std::istream& in, std:: ostream& out, bool benchmark = false);
+int launcher(std::istream& in, std:: ostream& out, bool benchmark, const LaunchOptions& options);
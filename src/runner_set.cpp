@@ -5,14 +5,17 @@
 #include <iostream>
 #include <stdexcept>
 
-int launcher_set(std::istream& in, std::ostream& out, bool benchmark)
+namespace {
+
+template <typename Set>
+int run_commands(Set& tree, std::istream& in, std::ostream& out, bool benchmark)
 {
     using clock = std::chrono::steady_clock;
     using ns    = std::chrono::nanoseconds;
 
-    std::set<int> tree;
     char op;
     ns acc{0};
+    long long checksum = 0; // keeps the timed queries from being optimised away
     try
     {
         while (in >> op)
@@ -56,6 +59,7 @@ int launcher_set(std::istream& in, std::ostream& out, bool benchmark)
 
                     auto t1 = clock::now();
                     acc += (t1 - t0);
+                    checksum += ans;
                 } else {
                     int ans = 0;
                     if (b > a) {
@@ -78,6 +82,7 @@ int launcher_set(std::istream& in, std::ostream& out, bool benchmark)
     {
         auto nas = std::chrono::duration_cast<std::chrono::milliseconds>(acc).count();
         out << nas << " ms\n";
+        out << "checksum: " << checksum << '\n';
     }
     else
     {
@@ -85,3 +90,17 @@ int launcher_set(std::istream& in, std::ostream& out, bool benchmark)
     }
     return 0;
 }
+
+} // namespace
+
+int launcher_set(std::istream& in, std::ostream& out, bool benchmark)
+{
+    std::set<int> tree;
+    return run_commands(tree, in, out, benchmark);
+}
+
+int launcher_multiset(std::istream& in, std::ostream& out, bool benchmark)
+{
+    std::multiset<int> tree;
+    return run_commands(tree, in, out, benchmark);
+}
@@ -4,3 +4,4 @@
 #include <ostream>
 
 int launcher_set(std::istream& in, std:: ostream& out, bool benchmark = false);
+int launcher_multiset(std::istream& in, std:: ostream& out, bool benchmark = false); // std::multiset
@@ -0,0 +1,286 @@
+#include "server.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+bool is_space(char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+void request_stop(int) { stop_requested = 1; }
+
+struct Connection
+{
+    explicit Connection(int fd, Trees::SearchTree<int>& tree): fd_(fd), commands_(tree) {}
+    ~Connection() { ::close(fd_); }
+
+    int           fd_;
+    CommandStream commands_;
+    std::string   out_;            // answers not sent yet, from out_sent_ on
+    size_t        out_sent_ = 0;
+    bool          closing_  = false; // peer is done or sent garbage: close once out_ is sent
+    uint32_t      events_   = 0;
+};
+
+constexpr size_t read_chunk_      = 64 * 1024;
+constexpr int    reads_per_batch_ = 16;              // per wakeup, then the next connection
+constexpr size_t out_backlog_     = 4 * 1024 * 1024; // stop reading until the peer takes answers
+
+void update_events(int epoll_fd, Connection& conn)
+{
+    bool backlog    = conn.out_.size() - conn.out_sent_ > out_backlog_;
+    uint32_t events = (conn.closing_ || backlog) ? 0u : EPOLLIN;
+    if (conn.out_sent_ < conn.out_.size()) events |= EPOLLOUT;
+    if (events == conn.events_) return;
+
+    epoll_event ev{};
+    ev.events  = events;
+    ev.data.fd = conn.fd_;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd_, &ev);
+    conn.events_ = events;
+}
+
+// one send per batch of answers; false - close the connection (peer gone, or done and drained)
+bool flush_answers(Connection& conn)
+{
+    while (conn.out_sent_ < conn.out_.size())
+    {
+        ssize_t n = ::send(conn.fd_, conn.out_.data() + conn.out_sent_, conn.out_.size() - conn.out_sent_, MSG_NOSIGNAL);
+        if (n > 0) { conn.out_sent_ += static_cast<size_t>(n); continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        return false;
+    }
+    conn.out_.clear();
+    conn.out_sent_ = 0;
+    return !conn.closing_;
+}
+
+void read_batch(Connection& conn)
+{
+    char buf[read_chunk_];
+    try {
+        for (int i = 0; i < reads_per_batch_; ++i)
+        {
+            ssize_t n = ::read(conn.fd_, buf, sizeof(buf));
+            if (n > 0)
+            {
+                conn.commands_.feed(buf, static_cast<size_t>(n), conn.out_);
+                if (static_cast<size_t>(n) < sizeof(buf)) return;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+            if (n == 0) conn.commands_.finish(conn.out_);
+            conn.closing_ = true;
+            return;
+        }
+    }
+    catch (const std::exception& ex) {
+        conn.out_ += "error: ";
+        conn.out_ += ex.what();
+        conn.out_ += '\n';
+        conn.closing_ = true;
+    }
+}
+
+} // namespace
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Command stream ----------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+void CommandStream::feed(const char* data, size_t n, std::string& out)
+{
+    if (pending_.empty()) // common case: parse the read buffer in place
+    {
+        size_t used = run(data, data + n, false, out);
+        pending_.assign(data + used, n - used);
+        return;
+    }
+
+    pending_.append(data, n);
+    size_t used = run(pending_.data(), pending_.data() + pending_.size(), false, out);
+    pending_.erase(0, used);
+}
+
+void CommandStream::finish(std::string& out)
+{
+    size_t used = run(pending_.data(), pending_.data() + pending_.size(), true, out);
+    pending_.erase(0, used);
+    for (char c : pending_)
+        if (!is_space(c)) throw std::runtime_error("incomplete command at end of stream");
+    pending_.clear();
+}
+
+size_t CommandStream::run(const char* begin, const char* end, bool at_eof, std::string& out)
+{
+    const char* p    = begin;
+    const char* done = begin; // after the last complete command
+
+    // a number ends with whitespace; one that runs into `end` may continue in the next read
+    auto read_int = [&](int& value) -> bool
+    {
+        while (p != end && is_space(*p)) ++p;
+        if (p == end) return false;
+
+        const char* first = p;
+        while (p != end && !is_space(*p)) ++p;
+        if (p == end && !at_eof) return false;
+
+        auto [ptr, ec] = std::from_chars(first, p, value);
+        if (ec != std::errc() || ptr != p) throw std::runtime_error("bad number: " + std::string(first, p));
+        return true;
+    };
+
+    while (true)
+    {
+        while (p != end && is_space(*p)) ++p;
+        if (p == end) break;
+
+        char op = *p++;
+        if (op == 'k')
+        {
+            int x;
+            if (!read_int(x)) break;
+            tree_.insert(x);
+        }
+        else if (op == 'q')
+        {
+            int a, b;
+            if (!read_int(a) || !read_int(b)) break;
+
+            int ans = b > a ? tree_.range_query(a, b) : 0;
+            char buf[16];
+            auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), ans);
+            out.append(buf, ptr);
+            out += '\n';
+        }
+        else
+        {
+            throw std::runtime_error(std::string("unknown command: ") + op);
+        }
+        done = p;
+    }
+    return static_cast<size_t>(done - begin);
+}
+
+//-----------------------------------------------------------------------------------------------------
+//--------------------------- Server ------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------
+ServerOptions parse_server_options(int argc, char** argv)
+{
+    ServerOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--socket=", 0) == 0)
+            options.socket_path = arg.substr(9);
+        else if (arg.rfind("--buffer=", 0) == 0)
+            options.buffer  = std::stoul(arg.substr(9));
+        else if (arg.rfind("--reserve=", 0) == 0)
+            options.reserve = std::stoul(arg.substr(10));
+        else if (arg.rfind("--load-snapshot=", 0) == 0)
+            options.load_snapshot = arg.substr(16);
+        else
+            throw std::invalid_argument("unknown option: " + arg);
+    }
+    return options;
+}
+
+int serve(const ServerOptions& options)
+{
+    Trees::SearchTree<int> tree;
+    tree.reserve(options.reserve);
+    tree.set_write_buffer(options.buffer);
+    if (!options.load_snapshot.empty()) tree.load(options.load_snapshot);
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (options.socket_path.size() >= sizeof(addr.sun_path))
+        throw std::invalid_argument("socket path too long: " + options.socket_path);
+    std::memcpy(addr.sun_path, options.socket_path.c_str(), options.socket_path.size() + 1);
+
+    int listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+    ::unlink(options.socket_path.c_str());
+    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listen_fd, 128) < 0)
+    {
+        std::string err = std::strerror(errno);
+        ::close(listen_fd);
+        throw std::runtime_error("failed to listen on " + options.socket_path + ": " + err);
+    }
+
+    int epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev{};
+    ev.events  = EPOLLIN;
+    ev.data.fd = listen_fd;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    struct sigaction sa{};
+    sa.sa_handler = request_stop; // no SA_RESTART: epoll_wait returns with EINTR
+    ::sigaction(SIGINT,  &sa, nullptr);
+    ::sigaction(SIGTERM, &sa, nullptr);
+
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    epoll_event events[64];
+
+    while (!stop_requested)
+    {
+        int n = ::epoll_wait(epoll_fd, events, 64, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd)
+            {
+                int client;
+                while ((client = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    auto conn = std::make_unique<Connection>(client, tree);
+                    epoll_event cev{};
+                    cev.events   = EPOLLIN;
+                    cev.data.fd  = client;
+                    conn->events_ = EPOLLIN;
+                    ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &cev);
+                    connections.emplace(client, std::move(conn));
+                }
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            Connection& conn = *it->second;
+
+            if (!conn.closing_ && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) read_batch(conn);
+
+            if (!flush_answers(conn))
+            {
+                connections.erase(it); // closes fd, which leaves the epoll set
+                continue;
+            }
+            update_events(epoll_fd, conn);
+        }
+    }
+
+    connections.clear();
+    ::close(epoll_fd);
+    ::close(listen_fd);
+    ::unlink(options.socket_path.c_str());
+    return 0;
+}
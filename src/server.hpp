@@ -0,0 +1,37 @@
+#pragma once
+
+#include <Trees/Tree.hpp>
+#include <cstddef>
+#include <string>
+
+struct ServerOptions
+{
+    std::string socket_path = "/tmp/tree_server.sock"; // --socket=PATH
+    size_t      buffer  = 0;   // --buffer=N: write buffer of N keys, 0 - off
+    size_t      reserve = 0;   // --reserve=N: pre-size the arena for N nodes
+    std::string load_snapshot; // --load-snapshot=PATH: start from a saved tree
+};
+
+ServerOptions parse_server_options(int argc, char** argv); // throws on an unknown flag
+
+// the launcher's text protocol (k x, q a b, any whitespace between tokens) over a byte
+// stream: every complete command runs against the tree, each q appends "answer\n" to out,
+// an incomplete tail waits for the next feed
+class CommandStream
+{
+    public:
+        explicit CommandStream(Trees::SearchTree<int>& tree): tree_(tree) {}
+
+        void feed(const char* data, size_t n, std::string& out); // std::runtime_error on a bad command
+        void finish(std::string& out);                           // end of stream, flushes the tail
+
+    private:
+        Trees::SearchTree<int>& tree_;
+        std::string             pending_; // incomplete command from the previous feed
+
+        size_t run(const char* begin, const char* end, bool at_eof, std::string& out);
+};
+
+// keeps one tree resident and serves every connection on a Unix domain socket with epoll;
+// returns after SIGINT/SIGTERM
+int serve(const ServerOptions& options);
@@ -0,0 +1,185 @@
+// load generator for tree_server: random k/q commands sent in batches, several batches in
+// flight on one connection; reports throughput and the round trip of a batch
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct ClientOptions
+{
+    std::string socket_path = "/tmp/tree_server.sock"; // --socket=PATH
+    size_t      requests = 1000000; // --requests=N: commands in total
+    size_t      batch    = 64;      // --batch=N: commands per batch, the last one is a q
+    size_t      pipeline = 8;       // --pipeline=N: batches sent before waiting for answers
+    unsigned    inserts  = 50;      // --inserts=P: percent of k commands
+    int         range    = 1000000; // --range=N: keys are in [0, N)
+    unsigned    seed     = 1;       // --seed=N
+};
+
+ClientOptions parse_client_options(int argc, char** argv)
+{
+    ClientOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--socket=", 0) == 0)        options.socket_path = arg.substr(9);
+        else if (arg.rfind("--requests=", 0) == 0) options.requests = std::stoul(arg.substr(11));
+        else if (arg.rfind("--batch=", 0) == 0)    options.batch    = std::max<size_t>(1, std::stoul(arg.substr(8)));
+        else if (arg.rfind("--pipeline=", 0) == 0) options.pipeline = std::max<size_t>(1, std::stoul(arg.substr(11)));
+        else if (arg.rfind("--inserts=", 0) == 0)  options.inserts  = std::min<unsigned>(100, std::stoul(arg.substr(10)));
+        else if (arg.rfind("--range=", 0) == 0)    options.range    = std::max(1, std::stoi(arg.substr(8)));
+        else if (arg.rfind("--seed=", 0) == 0)     options.seed     = static_cast<unsigned>(std::stoul(arg.substr(7)));
+        else throw std::invalid_argument("unknown option: " + arg);
+    }
+    if (!options.requests) throw std::invalid_argument("--requests must be positive");
+    return options;
+}
+
+int connect_to(const std::string& path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("socket path too long: " + path);
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        throw std::runtime_error("failed to connect to " + path + ": " + std::strerror(errno));
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+struct Batch
+{
+    size_t                  answers; // q commands still unanswered
+    clock_type::time_point  sent;
+};
+
+int run(const ClientOptions& options)
+{
+    int fd = connect_to(options.socket_path);
+
+    std::mt19937 rng(options.seed);
+    std::uniform_int_distribution<int> key(0, options.range - 1);
+    std::uniform_int_distribution<int> width(1, std::max(1, options.range / 100));
+    std::uniform_int_distribution<unsigned> percent(0, 99);
+
+    std::deque<Batch>   in_flight;
+    std::vector<double> latency_us;
+    std::string         out;
+    size_t              out_sent = 0;
+    size_t              issued   = 0;
+    size_t              answers  = 0;
+    char                buf[64 * 1024];
+
+    auto add_batch = [&]()
+    {
+        size_t commands = std::min(options.batch, options.requests - issued);
+        size_t queries  = 0;
+        for (size_t i = 0; i < commands; ++i)
+        {
+            if (i + 1 < commands && percent(rng) < options.inserts)
+            {
+                out += "k " + std::to_string(key(rng)) + '\n';
+                continue;
+            }
+            int a = key(rng);
+            out += "q " + std::to_string(a) + ' ' + std::to_string(a + width(rng)) + '\n';
+            ++queries;
+        }
+        issued += commands;
+        in_flight.push_back(Batch{queries, clock_type::now()});
+    };
+
+    auto start = clock_type::now();
+    while (issued < options.requests || !in_flight.empty())
+    {
+        while (in_flight.size() < options.pipeline && issued < options.requests) add_batch();
+
+        pollfd pfd{fd, POLLIN, 0};
+        if (out_sent < out.size()) pfd.events |= POLLOUT;
+        if (::poll(&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("poll: ") + std::strerror(errno));
+        }
+
+        if (pfd.revents & POLLOUT)
+        {
+            ssize_t n = ::send(fd, out.data() + out_sent, out.size() - out_sent, MSG_NOSIGNAL);
+            if (n > 0) out_sent += static_cast<size_t>(n);
+            if (out_sent == out.size()) { out.clear(); out_sent = 0; }
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if (n == 0) throw std::runtime_error("server closed the connection");
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR) continue;
+                throw std::runtime_error(std::string("read: ") + std::strerror(errno));
+            }
+            if (std::memchr(buf, 'e', static_cast<size_t>(n)))
+                throw std::runtime_error("server error: " + std::string(buf, static_cast<size_t>(n)));
+
+            auto now = clock_type::now();
+            for (const char* p = buf; (p = static_cast<const char*>(std::memchr(p, '\n', buf + n - p))); ++p)
+            {
+                ++answers;
+                if (--in_flight.front().answers == 0)
+                {
+                    latency_us.push_back(std::chrono::duration<double, std::micro>(now - in_flight.front().sent).count());
+                    in_flight.pop_front();
+                }
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    ::close(fd);
+
+    std::cout << options.requests << " requests (" << answers << " answers) in " << seconds << " s, "
+              << static_cast<long long>(options.requests / seconds) << " req/s\n";
+    if (latency_us.empty()) return 0;
+
+    std::sort(latency_us.begin(), latency_us.end());
+    auto pct = [&](double q) { return latency_us[static_cast<size_t>(q * (latency_us.size() - 1))]; };
+    double mean = 0;
+    for (double l : latency_us) mean += l / latency_us.size();
+
+    std::cout << "batch of " << options.batch << ", " << options.pipeline << " in flight, round trip us: "
+              << "mean " << mean << ", p50 " << pct(0.5) << ", p99 " << pct(0.99) << ", max " << latency_us.back() << '\n';
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    try
+    {
+    return run(parse_client_options(argc, argv));
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
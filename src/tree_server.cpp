@@ -0,0 +1,16 @@
+#include "server.hpp"
+#include <iostream>
+#include <exception>
+
+int main(int argc, char** argv)
+{
+    try
+    {
+    return serve(parse_server_options(argc, argv));
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
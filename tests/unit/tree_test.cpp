@@ -1,7 +1,15 @@
 #include <Trees/Tree.hpp>
 #include <gtest/gtest.h>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <random>
 #include <vector>
+#include <set>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
 using ST = Trees::SearchTree<int>;
 static std::vector<int> make_data(size_t n, uint32_t seed=42) {
     std::mt19937 rng(seed);
@@ -115,3 +123,774 @@ TEST(DistanceFast, EdgeCases) {
     int t_got   = t.distance(f3,s3);
     EXPECT_EQ(t_got, -2);
 }
+
+using MST = Trees::MultiSearchTree<int>;
+
+TEST(Multiset, CountsDuplicates) {
+    MST t;
+    for (int x : {10,10,20,20,20,30}) t.insert(x);
+    t.insert(40, 5);
+
+    EXPECT_EQ(t.size(), 11);
+    EXPECT_EQ(t.count(20), 3);
+    EXPECT_EQ(t.count(25), 0);
+    EXPECT_EQ(t.range_query(10,20), 5);
+    EXPECT_EQ(t.range_query(15,40), 9);
+    EXPECT_EQ(t.range_query(0,100), 11);
+
+    ST s;
+    for (int x : {10,10,20}) s.insert(x);
+    s.insert(30, 4);
+    EXPECT_EQ(s.size(), 3);
+    EXPECT_EQ(s.count(30), 1);
+}
+
+TEST(Multiset, EraseOneMatchesStdMultiset) {
+    MST t;
+    std::multiset<int> s;
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> key(0, 300);
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        int x = key(rng);
+        if (rng() % 3 == 0)
+        {
+            auto it = s.find(x);
+            bool had = (it != s.end());
+            if (had) s.erase(it);
+            EXPECT_EQ(t.erase_one(x), had);
+        }
+        else
+        {
+            t.insert(x);
+            s.insert(x);
+        }
+    }
+
+    ASSERT_EQ(t.size(), static_cast<int>(s.size()));
+    for (int a = -10; a < 320; a += 17)
+    {
+        int exp = static_cast<int>(std::distance(s.lower_bound(a), s.upper_bound(a + 40)));
+        EXPECT_EQ(t.range_query(a, a + 40), exp);
+    }
+
+    ST u;
+    for (int x : {1,2,3,4,5,6,7}) u.insert(x);
+    for (int x : {4,1,7}) EXPECT_TRUE(u.erase_one(x));
+    EXPECT_FALSE(u.erase_one(4));
+    EXPECT_EQ(u.range_query(0,10), 4);
+    EXPECT_EQ(u.lower_bound(4)->key_, 5);
+}
+
+TEST(FingerInsert, SortedAndNearlySortedRuns) {
+    ST t;
+    std::set<int> s;
+    std::mt19937 rng(3);
+
+    for (int i = 0; i < 3000; ++i)  { t.insert(i); s.insert(i); }
+    for (int i = -1; i > -3000; --i) { t.insert(i); s.insert(i); }
+    for (int i = 0; i < 3000; ++i)
+    {
+        int x = 10000 + 4 * i + static_cast<int>(rng() % 9);
+        t.insert(x); s.insert(x);
+    }
+
+    ASSERT_EQ(t.size(), static_cast<int>(s.size()));
+    for (int a = -3500; a < 23000; a += 997)
+    {
+        int exp = static_cast<int>(std::distance(s.lower_bound(a), s.upper_bound(a + 500)));
+        EXPECT_EQ(t.range_query(a, a + 500), exp);
+    }
+}
+
+TEST(FingerInsert, HintSemantics) {
+    ST t;
+    auto h = t.insert(nullptr, 10);
+    ASSERT_NE(h, nullptr); EXPECT_EQ(h->key_, 10);
+
+    for (int x = 20; x <= 100; x += 10) t.insert(nullptr, x); // append at end
+    t.insert(t.lower_bound(50), 45);                         // right before hint
+    t.insert(t.lower_bound(50), 5);                          // wrong hint, still correct
+    auto dup = t.insert(t.root(), 30);
+    EXPECT_EQ(dup->key_, 30);
+
+    EXPECT_EQ(t.size(), 12);
+    EXPECT_EQ(t.range_query(0, 45), 6);
+    EXPECT_EQ(t.upper_bound(45)->key_, 50);
+}
+
+// count_ is stored only in multi-mode nodes
+template <typename NodePtr>
+static auto node_multiplicity(NodePtr node, int) -> decltype(node->count_) { return node->count_; }
+template <typename NodePtr>
+static int node_multiplicity(NodePtr, long) { return 1; }
+
+// returns height of the subtree, checks parent links and size_ augmentation
+template <typename NodePtr>
+static int check_links(NodePtr node, NodePtr parent) {
+    if (!node) return 0;
+    EXPECT_EQ(node->parent_, parent);
+    int lh = check_links(node->left(),  node);
+    int rh = check_links(node->right(), node);
+    int ls = node->left()  ? node->left()->size_  : 0;
+    int rs = node->right() ? node->right()->size_ : 0;
+    EXPECT_EQ(node->size_, node_multiplicity(node, 0) + ls + rs);
+    return 1 + std::max(lh, rh);
+}
+
+template <typename NodePtr>
+static int node_meta(NodePtr node) { return node ? node->height_ : 0; }
+
+// policy invariant on height_ for every node
+template <typename NodePtr>
+static void check_policy(NodePtr node, Trees::AvlBalance) {
+    if (!node) return;
+    int lh = node_meta(node->left()), rh = node_meta(node->right());
+    EXPECT_LE(std::abs(lh - rh), 1);
+    EXPECT_EQ(node->height_, 1 + std::max(lh, rh));
+    check_policy(node->left(), Trees::AvlBalance{});
+    check_policy(node->right(), Trees::AvlBalance{});
+}
+template <typename NodePtr>
+static void check_policy(NodePtr node, Trees::WavlBalance) {
+    if (!node) return;
+    int dl = node->height_ - node_meta(node->left()), dr = node->height_ - node_meta(node->right());
+    EXPECT_TRUE(dl == 1 || dl == 2);
+    EXPECT_TRUE(dr == 1 || dr == 2);
+    if (!node->left() && !node->right()) { EXPECT_EQ(node->height_, 1); }
+    check_policy(node->left(), Trees::WavlBalance{});
+    check_policy(node->right(), Trees::WavlBalance{});
+}
+template <typename NodePtr>
+static void check_policy(NodePtr node, Trees::TreapBalance) {
+    if (!node) return;
+    if (node->parent_) { EXPECT_LE(node->height_, node->parent_->height_); }
+    check_policy(node->left(), Trees::TreapBalance{});
+    check_policy(node->right(), Trees::TreapBalance{});
+}
+
+template <typename Tree, typename Balance>
+static void check_tree(const Tree& t, Balance policy) {
+    check_links(t.root(), decltype(t.root()){nullptr});
+    check_policy(t.root(), policy);
+}
+
+TEST(Balancing, InvariantsWithEarlyStopAndDuplicates) {
+    ST  t;
+    MST m;
+    std::mt19937 rng(11);
+    for (int i = 0; i < 20000; ++i)
+    {
+        int x = (i % 3 == 0) ? i : static_cast<int>(rng() % 5000); // runs mixed with duplicates
+        t.insert(x);
+        m.insert(x);
+    }
+    check_tree(t, Trees::AvlBalance{});
+    check_tree(m, Trees::AvlBalance{});
+    EXPECT_EQ(m.size(), 20000);
+}
+
+template <typename Balance>
+class Policies : public ::testing::Test {};
+using BalanceTypes = ::testing::Types<Trees::AvlBalance, Trees::WavlBalance, Trees::TreapBalance>;
+TYPED_TEST_SUITE(Policies, BalanceTypes);
+
+TYPED_TEST(Policies, MatchStdMultisetUnderInsertAndErase) {
+    Trees::SearchTree<int, std::less<int>, true, TypeParam> t;
+    Trees::SearchTree<int, std::less<int>, false, TypeParam> u;
+    std::multiset<int> s;
+    std::mt19937 rng(5);
+
+    for (int i = 0; i < 30000; ++i)
+    {
+        int x = (i % 4 == 0) ? i / 4 : static_cast<int>(rng() % 4000);
+        if (rng() % 4 == 0)
+        {
+            auto it = s.find(x);
+            bool had = (it != s.end());
+            if (had) s.erase(it);
+            EXPECT_EQ(t.erase_one(x), had);
+            u.erase_one(x);
+        }
+        else
+        {
+            t.insert(x);
+            u.insert(x);
+            s.insert(x);
+        }
+    }
+
+    check_tree(t, TypeParam{});
+    check_tree(u, TypeParam{});
+    ASSERT_EQ(t.size(), static_cast<int>(s.size()));
+    for (int a = -10; a < 8000; a += 311)
+    {
+        int exp = static_cast<int>(std::distance(s.lower_bound(a), s.upper_bound(a + 200)));
+        EXPECT_EQ(t.range_query(a, a + 200), exp);
+    }
+}
+
+TEST(WriteBuffer, QueriesSeeBufferedKeys) {
+    ST  t;
+    MST m;
+    std::set<int> s;
+    std::multiset<int> ms;
+    t.set_write_buffer(64);
+    m.set_write_buffer(64);
+    std::mt19937 rng(9);
+
+    for (int i = 0; i < 5000; ++i)
+    {
+        int x = static_cast<int>(rng() % 2000);
+        t.insert(x); s.insert(x);
+        m.insert(x); ms.insert(x);
+        if (i % 97 == 0)
+        {
+            int a = static_cast<int>(rng() % 2000);
+            EXPECT_EQ(t.range_query(a, a + 150),
+                      static_cast<int>(std::distance(s.lower_bound(a), s.upper_bound(a + 150))));
+            EXPECT_EQ(m.range_query(a, a + 150),
+                      static_cast<int>(std::distance(ms.lower_bound(a), ms.upper_bound(a + 150))));
+            EXPECT_EQ(m.count(a), static_cast<int>(ms.count(a)));
+        }
+    }
+    EXPECT_EQ(t.size(), static_cast<int>(s.size()));
+    EXPECT_EQ(m.size(), static_cast<int>(ms.size()));
+
+    EXPECT_TRUE(m.erase_one(*ms.begin())); // merges the buffer first
+    EXPECT_EQ(m.size(), static_cast<int>(ms.size()) - 1);
+
+    t.flush();
+    check_tree(t, Trees::AvlBalance{});
+    EXPECT_EQ(t.range_query(-1, 5000), static_cast<int>(s.size()));
+
+    // set mode: a buffered repeat of a tree key counts once, whichever query meets it first
+    ST r;
+    for (int x : {10, 20, 30}) r.insert(x);
+    r.set_write_buffer(8);
+    for (int x : {20, 25, 30, 35, 25}) r.insert(x);
+    EXPECT_EQ(r.range_query(20, 30), 3);
+    ST r_copy = r;
+    EXPECT_EQ(r.size(), 5);
+    EXPECT_EQ(r_copy.size(), 5);
+    EXPECT_EQ(r_copy.count(30), 1);
+    r.flush();
+    check_tree(r, Trees::AvlBalance{});
+    EXPECT_EQ(r.size(), 5);
+    EXPECT_EQ(r.range_query(0, 100), 5);
+}
+
+TEST(Snapshot, SaveLoadRoundTrip) {
+    std::string path = ::testing::TempDir() + "tree_snapshot.bin";
+
+    MST a;
+    auto data = make_data(3000);
+    for (int x : data) { a.insert(x); a.insert(x % 100); }
+    a.save(path);
+
+    MST b;
+    b.insert(7);
+    b.load(path);
+    check_tree(b, Trees::AvlBalance{});
+    EXPECT_EQ(b.size(), a.size());
+    for (auto [l, r] : std::vector<std::pair<int,int>>{{-1'000'000, 1'000'000}, {0, 99}, {-500, 12345}})
+        EXPECT_EQ(b.range_query(l, r), a.range_query(l, r));
+
+    b.insert(42);                          // loaded tree stays writable
+    EXPECT_EQ(b.count(42), a.count(42) + 1);
+
+    MST r;                                 // reserved room survives the load
+    r.reserve(100000);
+    size_t reserved = r.memory_stats().bytes_reserved;
+    r.load(path);
+    EXPECT_EQ(r.memory_stats().blocks, 1u);
+    EXPECT_GE(r.memory_stats().bytes_reserved, reserved);
+    for (int x = 0; x < 50000; ++x) r.insert(2'000'000 + x);
+    EXPECT_EQ(r.memory_stats().blocks, 1u);
+    EXPECT_EQ(r.size(), a.size() + 50000);
+
+    ST empty;
+    empty.save(path);
+    ST c;
+    c.insert(1);
+    c.load(path);
+    EXPECT_EQ(c.root(), nullptr);
+
+    Trees::SearchTree<int, std::less<int>, false, Trees::WavlBalance> wrong;
+    EXPECT_THROW(wrong.load(path), std::runtime_error);
+    EXPECT_THROW(c.load(path + ".missing"), std::runtime_error);
+    std::remove(path.c_str());
+}
+
+TEST(Snapshot, ShortFileIsRejectedBeforeAllocation) {
+    std::string path = ::testing::TempDir() + "tree_snapshot_short.bin";
+
+    ST a;
+    for (int x : make_data(100)) a.insert(x);
+    a.save(path);
+
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto rewrite = [&](const std::string& content)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(content.data(), static_cast<std::streamsize>(content.size()));
+    };
+
+    ST b;
+    b.insert(7);
+
+    rewrite(bytes.substr(0, bytes.size() - 1)); // last record cut short
+    EXPECT_THROW(b.load(path), std::runtime_error);
+
+    std::string forged = bytes; // node count of the header (after magic, balance, key size, multi)
+    std::uint64_t nodes = std::uint64_t{1} << 60;
+    std::memcpy(&forged[24], &nodes, sizeof(nodes));
+    rewrite(forged);
+    EXPECT_THROW(b.load(path), std::runtime_error);
+
+    EXPECT_EQ(b.size(), 1); // a failed load leaves the tree as it was
+    EXPECT_EQ(b.count(7), 1);
+
+    rewrite(bytes);
+    b.load(path);
+    EXPECT_EQ(b.size(), a.size());
+    std::remove(path.c_str());
+}
+
+TEST(Arena, PoliciesReserveAndGrowth) {
+    std::pmr::monotonic_buffer_resource upstream;
+    Trees::SearchTree<int, std::less<int>, false, Trees::AvlBalance, Trees::PmrArena> p;
+    p.arena() = Trees::PmrArena{&upstream};
+    p.arena().set_growth(16, 1.5, 64);
+
+    Trees::SearchTree<int, std::less<int>, true, Trees::WavlBalance, Trees::HugePageArena> h;
+    h.reserve(10000);
+
+    std::multiset<int> s;
+    for (int x : make_data(5000)) { p.insert(x); h.insert(x); h.insert(x); s.insert(x); }
+
+    auto copy = p;
+    EXPECT_EQ(copy.size(), p.size());
+    EXPECT_EQ(h.size(), 2 * static_cast<int>(s.size()));
+    EXPECT_TRUE(h.erase_one(*s.begin()));
+    check_tree(p, Trees::AvlBalance{});
+    check_tree(h, Trees::WavlBalance{});
+
+    ST r; // reserve counts the free slots of the current block
+    r.arena().set_growth(16, 2.0);
+    for (int x = 0; x < 10; ++x) r.insert(x);
+    r.reserve(100);
+    EXPECT_EQ(r.memory_stats().bytes_reserved, 100 * r.memory_stats().node_size);
+    for (int x = 10; x < 100; ++x) r.insert(x);
+    EXPECT_EQ(r.memory_stats().blocks, 2u);
+
+    Trees::BlockGrowth g;
+    g.set_growth(512, 2.0, 2048);
+    EXPECT_EQ(g.next_capacity(0), 512u);
+    EXPECT_EQ(g.next_capacity(1024), 2048u);
+    EXPECT_EQ(g.next_capacity(2048), 2048u);
+}
+
+TEST(RuleOfFive, CopyIsVebLaidOutInOneBlock) {
+    for (int n : {1, 1000, 200000}) // the last one takes the parallel path
+    {
+        MST a;
+        for (int x : make_data(static_cast<size_t>(n), 17)) { a.insert(x); a.insert(x % 1000); }
+        a.erase_one(a.root()->key_);
+
+        MST b = a;
+        check_tree(b, Trees::AvlBalance{});
+        EXPECT_EQ(b.size(), a.size());
+        EXPECT_EQ(b.node_count(), a.node_count());
+        EXPECT_EQ(b.range_query(-1'000'000, 1'000'000), a.range_query(-1'000'000, 1'000'000));
+        EXPECT_EQ(b.range_query(0, 999), a.range_query(0, 999));
+
+        auto root = b.root(); // vEB order: the root and its children are the first nodes
+        if (root->left())  { EXPECT_EQ(root->left(), root + 1); }
+        if (root->right()) { EXPECT_EQ(root->right(), root + (root->left() ? 2 : 1)); }
+
+        b.insert(123456789);
+        EXPECT_EQ(b.size(), a.size() + 1);
+    }
+}
+
+TEST(RuleOfFive, CopySplitsVebByNodesNotCopies) {
+    MST a; // 15 distinct keys make a perfect tree of 4 levels, whatever the multiplicity
+    for (int rep = 0; rep < 1000; ++rep)
+        for (int k = 0; k < 15; ++k) a.insert(k);
+
+    MST b = a;
+    check_tree(b, Trees::AvlBalance{});
+    EXPECT_EQ(b.size(), 15000);
+
+    // 4 levels split 2 + 2: the top triangle first, then each bottom triangle in turn
+    auto root = b.root();
+    ASSERT_NE(root->left(), nullptr);
+    ASSERT_NE(root->left()->left(), nullptr);
+    EXPECT_EQ(root->left(), root + 1);
+    EXPECT_EQ(root->right(), root + 2);
+    EXPECT_EQ(root->left()->left(), root + 3);
+    EXPECT_EQ(root->left()->left()->left(), root + 4);
+}
+
+// key that counts how it was made; compared with plain ints through a transparent comparator
+struct Tracked {
+    static inline int builds = 0, copies = 0;
+    int v;
+    explicit Tracked(int x): v(x) { if (x == 13) throw std::runtime_error("unlucky"); ++builds; }
+    Tracked(const Tracked& o): v(o.v) { ++copies; }
+    Tracked(Tracked&&) noexcept = default;
+    Tracked& operator=(const Tracked& o) { v = o.v; ++copies; return *this; }
+    Tracked& operator=(Tracked&&) noexcept = default;
+};
+struct TrackedLess {
+    using is_transparent = void;
+    static int v(const Tracked& t) { return t.v; }
+    static int v(int x) { return x; }
+    template <typename A, typename B>
+    bool operator()(const A& a, const B& b) const { return v(a) < v(b); }
+};
+
+TEST(Heterogeneous, StringViewLookups) {
+    Trees::SearchTree<std::string, std::less<>> t;
+    for (const char* s : {"apple", "banana", "cherry", "date"}) t.emplace(std::string_view{s});
+
+    using namespace std::literals;
+    EXPECT_EQ(t.range_query("b"sv, "d"sv), 2);
+    EXPECT_EQ(t.count("cherry"sv), 1);
+    EXPECT_EQ(t.count("fig"sv), 0);
+    ASSERT_NE(t.lower_bound("c"sv), nullptr);
+    EXPECT_EQ(t.lower_bound("c"sv)->key_, "cherry");
+    EXPECT_EQ(t.upper_bound("date"sv), nullptr);
+    EXPECT_EQ(t.range_query(std::string("a"), std::string("z")), 4);
+}
+
+TEST(Heterogeneous, KeysBuiltOnlyForNewNodes) {
+    for (size_t buffer : {size_t{0}, size_t{256}}) // the buffer holds all distinct keys
+    {
+        Tracked::builds = Tracked::copies = 0;
+        Trees::SearchTree<Tracked, TrackedLess> t;
+        t.set_write_buffer(buffer);
+
+        for (int i = 0; i < 1000; ++i) t.emplace(100 + i % 100); // 900 duplicates
+        t.insert(Tracked{500});
+        t.flush();
+
+        EXPECT_EQ(Tracked::builds, 101);
+        EXPECT_EQ(Tracked::copies, 0);
+        EXPECT_EQ(t.size(), 101);
+        EXPECT_EQ(t.range_query(110, 119), 10);
+        EXPECT_EQ(t.count(500), 1);
+        check_tree(t, Trees::AvlBalance{});
+    }
+}
+
+TEST(Heterogeneous, ThrowingKeyLeavesTreeIntact) {
+    Trees::MultiSearchTree<Tracked, TrackedLess> t;
+    for (int i : {10, 20, 30, 12, 14}) t.emplace(i);
+
+    EXPECT_THROW(t.emplace(13), std::runtime_error);
+    EXPECT_EQ(t.size(), 5);
+    EXPECT_EQ(t.count(13), 0);
+    check_tree(t, Trees::AvlBalance{});
+
+    t.emplace(15);
+    EXPECT_EQ(t.range_query(10, 15), 4);
+    check_tree(t, Trees::AvlBalance{});
+}
+
+static std::vector<std::string> make_urls(size_t n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    const char* hosts[] = {"https://a.example/", "https://a.example/api/", "https://b.example/", ""};
+    std::vector<std::string> v(n);
+    for (auto& s : v)
+    {
+        s = hosts[rng() % 4];
+        for (size_t len = rng() % 12; len; --len) s += static_cast<char>("ab\0z/"[rng() % 5]); // embedded zeros too
+    }
+    return v;
+}
+
+TEST(PrefixString, OrderMatchesStdString) {
+    auto urls = make_urls(3000, 5);
+    for (size_t i = 0; i + 1 < urls.size(); ++i)
+    {
+        Trees::PrefixString a(urls[i]), b(urls[i + 1]);
+        EXPECT_EQ(a < b, urls[i] < urls[i + 1]);
+        EXPECT_EQ(b < a, urls[i + 1] < urls[i]);
+        EXPECT_EQ(a == b, urls[i] == urls[i + 1]);
+    }
+    EXPECT_TRUE(Trees::PrefixString("ab") < Trees::PrefixString(std::string("ab\0", 3)));
+    EXPECT_EQ(Trees::PrefixString("abcdefgh").prefix(), 0x6162636465666768ull);
+
+    // prefix ties: shorter than 8 bytes, exactly 8, zero bytes inside and past the prefix
+    using namespace std::literals;
+    std::vector<std::string> keys = {""s, "\0"s, "a"s, "a\0"s, "ab"s, "abcdefg"s, "abcdefg\0"s,
+                                     "abcdefgh"s, "abcdefgh\0"s, "abcdefgha"s, "abcdefghb"s,
+                                     "abcdefgh\0a"s, "item/key/0000000001"s, "item/key/0000000010"s,
+                                     "item/key/00000000010"s, "item/key/"s, "item/ke"s};
+    for (const auto& x : keys)
+        for (const auto& y : keys)
+        {
+            Trees::PrefixString a(x), b(y);
+            EXPECT_EQ(a < b, x < y) << x << " < " << y;
+            EXPECT_EQ(a == b, x == y) << x << " == " << y;
+        }
+}
+
+TEST(PrefixString, TreeOwnsKeyBytes) {
+    auto urls = make_urls(5000, 9);
+    std::multiset<std::string> ref;
+
+    using PT = Trees::MultiSearchTree<Trees::PrefixString>;
+    auto b = std::make_unique<PT>();
+    b->set_write_buffer(128);
+    for (auto& u : urls)
+    {
+        b->emplace(std::string_view(u));
+        ref.insert(u);
+        u.assign(u.size(), '#'); // the tree must not refer to the caller's bytes
+    }
+    b->erase_one(ref.begin()->c_str());
+    ref.erase(ref.begin());
+
+    PT copy = *b;
+    b.reset();
+
+    check_tree(copy, Trees::AvlBalance{});
+    EXPECT_EQ(copy.size(), static_cast<int>(ref.size()));
+    const char* probes[] = {"", "https://a.example/", "https://a.example/api/a", "https://b.example/z", "~"};
+    for (const char* lo : probes)
+        for (const char* hi : probes)
+        {
+            int expected = 0;
+            if (std::string(lo) < hi)
+                expected = static_cast<int>(std::distance(ref.lower_bound(lo), ref.upper_bound(hi)));
+            EXPECT_EQ(copy.range_query(lo, hi), expected) << lo << " .. " << hi;
+        }
+    auto node = copy.lower_bound("https://b.example/");
+    ASSERT_NE(node, nullptr);
+    EXPECT_EQ(node->key_.view(), *ref.lower_bound("https://b.example/"));
+}
+
+TEST(PrefixString, MovedFromTreeIsReusable) {
+    using PT = Trees::SearchTree<Trees::PrefixString>;
+    auto first = make_urls(100, 3);
+    PT a;
+    for (const auto& u : first) a.emplace(std::string_view(u));
+
+    auto b = std::make_unique<PT>(std::move(a));
+    PT c;
+    c.emplace(std::string_view("https://c.example/"));
+    c = std::move(*b); // c's old keys and b's blocks change hands
+    b.reset();
+
+    auto urls = make_urls(200, 4); // the moved-from trees must not write into c's blocks
+    for (const auto& u : urls) a.emplace(std::string_view(u));
+    c.emplace(std::string_view("https://d.example/"));
+    EXPECT_EQ(a.size(), static_cast<int>(std::set<std::string>(urls.begin(), urls.end()).size()));
+    EXPECT_EQ(c.size(), static_cast<int>(std::set<std::string>(first.begin(), first.end()).size()) + 1);
+    EXPECT_EQ(a.count(std::string_view(urls[0])), 1);
+}
+
+struct OpaqueLess { bool operator()(int a, int b) const { return a < b; } }; // keeps the generic path
+
+TEST(HotLayout, BranchlessDescentMatchesGeneric) {
+    MST hot;
+    Trees::MultiSearchTree<int, OpaqueLess> generic;
+    EXPECT_LT(sizeof(*hot.root()), sizeof(*generic.root()));
+
+    for (int x : make_data(20000, 23)) { hot.insert(x % 5000); generic.insert(x % 5000); }
+
+    std::mt19937 rng(29);
+    for (int i = 0; i < 2000; ++i)
+    {
+        int a = static_cast<int>(rng() % 12000) - 6000;
+        int b = a + static_cast<int>(rng() % 3000);
+        auto hl = hot.lower_bound(a);
+        auto gl = generic.lower_bound(a);
+        auto hu = hot.upper_bound(a);
+        auto gu = generic.upper_bound(a);
+        ASSERT_EQ(hl == nullptr, gl == nullptr);
+        ASSERT_EQ(hu == nullptr, gu == nullptr);
+        if (hl) { EXPECT_EQ(hl->key_, gl->key_); }
+        if (hu) { EXPECT_EQ(hu->key_, gu->key_); }
+        EXPECT_EQ(hot.range_query(a, b), generic.range_query(a, b));
+        EXPECT_EQ(hot.count(a), generic.count(a));
+    }
+    check_tree(hot, Trees::AvlBalance{});
+}
+
+TEST(Introspection, MemoryAndShapeStats) {
+    ST empty;
+    EXPECT_EQ(empty.memory_stats().blocks, 0u);
+    EXPECT_EQ(empty.shape_stats().height, 0);
+    EXPECT_EQ(empty.memory_stats().node_size, 40u);
+    EXPECT_EQ(Trees::SearchTree<double>().memory_stats().node_size, 40u);
+    EXPECT_LT(Trees::SearchTree<std::string>().memory_stats().node_size, // no count_ in set mode
+              Trees::MultiSearchTree<std::string>().memory_stats().node_size);
+
+    ST t;
+    t.reserve(1000);
+    for (int x = 1; x <= 511; ++x) t.insert(x); // sorted inserts give a perfect AVL tree
+
+    Trees::MemoryStats mem = t.memory_stats();
+    EXPECT_EQ(mem.blocks, 1u);
+    EXPECT_EQ(mem.nodes, 511u);
+    EXPECT_EQ(mem.bytes_used, 511 * mem.node_size);
+    EXPECT_GE(mem.bytes_reserved, 1000 * mem.node_size);
+    EXPECT_NEAR(mem.utilization(), double(mem.bytes_used) / double(mem.bytes_reserved), 1e-12);
+
+    Trees::ShapeStats shape = t.shape_stats();
+    EXPECT_EQ(shape.height, 9);
+    for (size_t d = 0; d < shape.depth_histogram.size(); ++d)
+        EXPECT_EQ(shape.depth_histogram[d], size_t{1} << d);
+    EXPECT_NEAR(shape.average_path, (8.0 * 512 + 1) / 511, 1e-9); // sum (d + 1) 2^d
+    EXPECT_GE(shape.max_path_lines, 9u);
+}
+
+TEST(Introspection, CopyLayoutTouchesFewerCacheLines) {
+    ST a;
+    for (int x : make_data(100000, 31)) a.insert(x);
+    ST b = a;
+
+    Trees::ShapeStats sa = a.shape_stats(), sb = b.shape_stats();
+    EXPECT_EQ(sa.depth_histogram, sb.depth_histogram);
+    EXPECT_LT(sb.average_path_lines, sa.average_path_lines);
+    EXPECT_EQ(b.memory_stats().blocks, 1u);
+    EXPECT_DOUBLE_EQ(b.memory_stats().utilization(), 1.0);
+}
+
+template <typename Tree>
+static void check_cached_queries(Tree& cached, size_t buffer) {
+    Tree plain;
+    cached.set_write_buffer(buffer);
+    plain.set_write_buffer(buffer);
+    cached.set_query_cache(64);
+
+    std::mt19937 rng(41);
+    for (int i = 0; i < 20000; ++i)
+    {
+        int x = static_cast<int>(rng() % 2000);
+        switch (rng() % 8)
+        {
+            case 0: case 1: cached.insert(x); plain.insert(x); break;
+            case 2: ASSERT_EQ(cached.erase_one(x), plain.erase_one(x)); break;
+            default: // a small set of hot ranges
+            {
+                int a = static_cast<int>(rng() % 40) * 50;
+                ASSERT_EQ(cached.range_query(a, a + 300), plain.range_query(a, a + 300)) << "query " << i;
+            }
+        }
+    }
+    EXPECT_GT(cached.query_cache_stats().hits, 0);
+    EXPECT_GT(cached.query_cache_stats().adjusted, 0);
+}
+
+TEST(QueryCache, MatchesUncachedTree) {
+    ST set_tree;
+    check_cached_queries(set_tree, 0);
+    ST buffered;
+    check_cached_queries(buffered, 64);
+    MST multi;
+    check_cached_queries(multi, 64);
+}
+
+TEST(QueryCache, StaleEntriesAdjustedFromChangeLog) {
+    ST t;
+    for (int x = 0; x < 100; ++x) t.insert(x);
+    t.set_query_cache(16);
+
+    EXPECT_EQ(t.range_query(10, 20), 11);
+    EXPECT_EQ(t.range_query(10, 20), 11);
+    EXPECT_EQ(t.query_cache_stats().hits, 1);
+
+    t.insert(500);  // outside [10, 20]
+    t.insert(15);   // duplicate, not a change
+    t.erase_one(12);
+    EXPECT_EQ(t.range_query(10, 20), 10);
+    EXPECT_EQ(t.query_cache_stats().adjusted, 1);
+    EXPECT_EQ(t.query_cache_stats().misses, 1);
+
+    for (int x = 1000; x < 1100; ++x) t.insert(x); // more changes than the log keeps
+    EXPECT_EQ(t.range_query(10, 20), 10);
+    EXPECT_EQ(t.query_cache_stats().misses, 2);
+
+    t.set_write_buffer(16); // buffered inserts are logged the same way
+    t.range_query(10, 20);
+    t.insert(5000);
+    t.insert(12);
+    t.insert(15); // already in the tree, not buffered
+    EXPECT_EQ(t.range_query(10, 20), 11);
+    EXPECT_EQ(t.query_cache_stats().adjusted, 2);
+    EXPECT_EQ(t.range_query(30, 40), 11);
+    EXPECT_EQ(t.query_cache_stats().misses, 3);
+
+    ST copy = t;
+    copy.insert(13);
+    EXPECT_EQ(copy.range_query(10, 20), 11);
+    EXPECT_EQ(t.range_query(10, 20), 11);
+}
+
+#ifdef TREES_TEST_SERVER
+#include "server.hpp"
+
+TEST(CommandStream, CommandsSplitAcrossReads) {
+    std::string input;
+    std::string expected;
+    ST reference;
+    std::mt19937 rng(37);
+    for (int i = 0; i < 5000; ++i)
+    {
+        int a = static_cast<int>(rng() % 20000) - 10000;
+        if (rng() % 2)
+        {
+            input += "k " + std::to_string(a) + (i % 7 ? " " : "\n\t");
+            reference.insert(a);
+        }
+        else
+        {
+            int b = a + static_cast<int>(rng() % 3000) - 100;
+            input += "q " + std::to_string(a) + "  " + std::to_string(b) + '\n';
+            expected += std::to_string(b > a ? reference.range_query(a, b) : 0) + '\n';
+        }
+    }
+    input += "q -100000 100000"; // the last number ends only with the stream
+    expected += std::to_string(reference.range_query(-100000, 100000)) + '\n';
+
+    ST tree;
+    CommandStream commands(tree);
+    std::string out;
+    for (size_t pos = 0; pos < input.size();)
+    {
+        size_t n = std::min<size_t>(1 + rng() % 13, input.size() - pos);
+        commands.feed(input.data() + pos, n, out);
+        pos += n;
+    }
+    EXPECT_LT(out.size(), expected.size());
+    commands.finish(out);
+    EXPECT_EQ(out, expected);
+}
+
+TEST(CommandStream, MalformedInput) {
+    ST tree;
+    std::string out;
+
+    CommandStream bad_op(tree);
+    EXPECT_THROW(bad_op.feed("k 1 x 2 ", 8, out), std::runtime_error);
+    EXPECT_EQ(tree.size(), 1);
+
+    CommandStream bad_number(tree);
+    EXPECT_THROW(bad_number.feed("q 1 2z ", 7, out), std::runtime_error);
+
+    CommandStream truncated(tree);
+    truncated.feed("q 5 ", 4, out);
+    EXPECT_THROW(truncated.finish(out), std::runtime_error);
+    EXPECT_TRUE(out.empty());
+}
+#endif